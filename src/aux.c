@@ -1,9 +1,12 @@
 #include "globals.h"
 
 struct Parameters Param;
+struct Kernel_Properties Kernel;
 struct HaloProperties Halo[MAXHALOS];
 struct ParticleData *P;
 struct GasParticleData *SphP;
+struct DMParticleData *DMP = NULL;
+struct GravityData *GravP = NULL;
 struct Units Unit;
 struct Universe Cosmo;
 
@@ -0,0 +1,360 @@
+#include "globals.h"
+#include "tree.h"
+
+#define CELL_MAX_LEVEL 8 // finest grid has 2^8 cells per side
+
+/*
+ * Cell linked list neighbour finder, an alternative to the tree for the near
+ * uniform gas distribution in the WVT relaxation. There is one grid per
+ * density level: A particle goes into the finest grid whose cells are larger
+ * than its hsml, so the search sphere of a particle covers 3^3 cells of its
+ * own grid. A query visits all grids, covering more cells in finer grids.
+ * Particles are stored by grid and cell, inside a cell they keep their Peano
+ * order. Only the gas is binned, the grids are invalid after particles move.
+ */
+
+static struct Cell_Grid {
+	int N;				// cells per side
+	float Size;			// cell side
+	float Hsml;			// largest hsml in the grid
+	int Npart;			// number of particles in the grid
+	int Max_Cells;		// allocated cells
+	int *First;			// first particle of a cell in Cell_Part, N^3+1 long
+	float *Hsml_Max;	// largest hsml in a cell
+} Grid[CELL_MAX_LEVEL+1] = { { 0 } };
+
+static int Max_Part = 0;
+static int *Cell_Part = NULL;			// particles ordered by grid and cell
+static float *Cell_Pos[3] = { NULL };	// their positions
+static float *Cell_Hsml = NULL;			// and hsml
+static int *Part_Cell = NULL;			// cell of a particle in its grid
+static char *Part_Level = NULL;			// grid of a particle
+
+static bool Cell_Hsml_Set = false; // symmetric search possible
+
+static inline float cell_hsml(const int ipart, const float *hsml,
+		const float scale);
+static inline int cell_index(const float x, const int N);
+static inline float cell_distance(const float x, const int idx, 
+		const float size);
+static inline int cell_ngb(const int, const float, const int, 
+		const struct Cell_Grid*, int, int[NGBMAX], const bool);
+static int cell_walk(const int ipart, const float hsml, int ngblist[NGBMAX],
+		const bool symmetric);
+
+/*
+ * Sort the gas particles into the grids. hsml*scale is the length of a
+ * particle, with hsml == NULL we use SphP[].Hsml or guess it from the tree.
+ * A symmetric search needs the particle hsml, so only the first is valid.
+ */
+
+void Build_Cells(const float *hsml, const float scale)
+{
+	const int npart = Param.Npart[0];
+	const double boxsize = Param.Boxsize;
+
+	if (npart > Max_Part) {
+
+		Max_Part = npart;
+
+		size_t nBytes = Max_Part * sizeof(float);
+
+		Cell_Part = Realloc(Cell_Part, Max_Part * sizeof(*Cell_Part));
+		Cell_Pos[0] = Realloc(Cell_Pos[0], nBytes);
+		Cell_Pos[1] = Realloc(Cell_Pos[1], nBytes);
+		Cell_Pos[2] = Realloc(Cell_Pos[2], nBytes);
+		Cell_Hsml = Realloc(Cell_Hsml, nBytes);
+		Part_Cell = Realloc(Part_Cell, Max_Part * sizeof(*Part_Cell));
+		Part_Level = Realloc(Part_Level, Max_Part * sizeof(*Part_Level));
+	}
+
+	int max_level = 0; // at least one particle per cell on average
+
+	while (max_level < CELL_MAX_LEVEL && (1L << 3*(max_level+1)) <= npart)
+		max_level++;
+
+	#pragma omp parallel for schedule(static)
+	for (int ipart = 0; ipart < npart; ipart++) {
+
+		const float h = cell_hsml(ipart, hsml, scale);
+
+		int lvl = floor(log2(boxsize / h));
+
+		lvl = max(0, min(max_level, lvl));
+
+		const int N = 1 << lvl;
+
+		Part_Level[ipart] = lvl;
+		Part_Cell[ipart] = (cell_index(P[ipart].Pos[0], N) * N
+						  + cell_index(P[ipart].Pos[1], N)) * N
+						  + cell_index(P[ipart].Pos[2], N);
+	}
+
+	for (int lvl = 0; lvl <= CELL_MAX_LEVEL; lvl++) {
+
+		Grid[lvl].N = 1 << lvl;
+		Grid[lvl].Size = boxsize / Grid[lvl].N;
+		Grid[lvl].Hsml = 0;
+		Grid[lvl].Npart = 0;
+	}
+
+	for (int ipart = 0; ipart < npart; ipart++)
+		Grid[(int) Part_Level[ipart]].Npart++;
+
+	for (int lvl = 0; lvl <= CELL_MAX_LEVEL; lvl++) {
+
+		struct Cell_Grid *g = &Grid[lvl];
+
+		if (g->Npart == 0)
+			continue;
+
+		const int nCells = g->N * g->N * g->N;
+
+		if (nCells + 1 > g->Max_Cells) {
+
+			g->Max_Cells = nCells + 1;
+
+			g->First = Realloc(g->First, g->Max_Cells * sizeof(*g->First));
+			g->Hsml_Max = Realloc(g->Hsml_Max, 
+					g->Max_Cells * sizeof(*g->Hsml_Max));
+		}
+
+		memset(g->First, 0, (nCells + 1) * sizeof(*g->First));
+		memset(g->Hsml_Max, 0, nCells * sizeof(*g->Hsml_Max));
+	}
+
+	for (int ipart = 0; ipart < npart; ipart++) // count
+		Grid[(int) Part_Level[ipart]].First[Part_Cell[ipart] + 1]++;
+
+	int offset = 0;
+
+	for (int lvl = 0; lvl <= CELL_MAX_LEVEL; lvl++) { // prefix sum
+
+		struct Cell_Grid *g = &Grid[lvl];
+
+		if (g->Npart == 0)
+			continue;
+
+		const int nCells = g->N * g->N * g->N;
+
+		g->First[0] = offset;
+
+		for (int i = 0; i < nCells; i++)
+			g->First[i+1] += g->First[i];
+
+		offset += g->Npart;
+	}
+
+	for (int ipart = 0; ipart < npart; ipart++) { // scatter in Peano order
+
+		struct Cell_Grid *g = &Grid[(int) Part_Level[ipart]];
+
+		const int i = g->First[Part_Cell[ipart]]++;
+
+		Cell_Part[i] = ipart;
+		Cell_Pos[0][i] = P[ipart].Pos[0];
+		Cell_Pos[1][i] = P[ipart].Pos[1];
+		Cell_Pos[2][i] = P[ipart].Pos[2];
+		Cell_Hsml[i] = cell_hsml(ipart, hsml, scale);
+
+		g->Hsml = max(g->Hsml, Cell_Hsml[i]);
+		g->Hsml_Max[Part_Cell[ipart]] = max(g->Hsml_Max[Part_Cell[ipart]],
+				Cell_Hsml[i]);
+	}
+
+	offset = 0;
+
+	for (int lvl = 0; lvl <= CELL_MAX_LEVEL; lvl++) { // undo scatter shift
+
+		struct Cell_Grid *g = &Grid[lvl];
+
+		if (g->Npart == 0)
+			continue;
+
+		const int nCells = g->N * g->N * g->N;
+
+		memmove(&g->First[1], &g->First[0], nCells * sizeof(*g->First));
+
+		g->First[0] = offset;
+
+		offset += g->Npart;
+	}
+
+	Cell_Hsml_Set = (hsml != NULL);
+
+	return ;
+}
+
+/*
+ * Find all particles with r_ij < hsml. Needs Build_Cells().
+ */
+
+int Find_ngb_cells(const int ipart, const float hsml, int *ngblist)
+{
+	const int ngbcnt = cell_walk(ipart, hsml, ngblist, false);
+
+	TREE_STAT(Ngbs_Found, ngbcnt);
+
+	return ngbcnt;
+}
+
+/*
+ * Find all particles with r_ij < max(hsml, hsml_j). Needs Build_Cells() with
+ * the particle hsml.
+ */
+
+int Find_ngb_cells_symmetric(const int ipart, const float hsml,
+		int *ngblist)
+{
+	Assert(Cell_Hsml_Set, "Cell hsml not set, call Build_Cells() with hsml");
+
+	const int ngbcnt = cell_walk(ipart, hsml, ngblist, true);
+
+	TREE_STAT(Ngbs_Found, ngbcnt);
+
+	return ngbcnt;
+}
+
+/*
+ * Visit the cells around ipart in every grid. A particle closer than rad
+ * is at most rad/size+1 cells away, wrapped periodically. Cells further 
+ * than rad are skipped, unless the range wraps around the whole box. In the
+ * symmetric search rad is the largest hsml of the grid, then of the cell.
+ */
+
+static int cell_walk(const int ipart, const float hsml, int ngblist[NGBMAX],
+		const bool symmetric)
+{
+	const float pos_i[3] = {P[ipart].Pos[0],P[ipart].Pos[1],P[ipart].Pos[2]};
+
+	int ngbcnt = 0;
+
+	TREE_STAT(Queries, 1);
+
+	for (int lvl = 0; lvl <= CELL_MAX_LEVEL; lvl++) {
+
+		const struct Cell_Grid *g = &Grid[lvl];
+
+		if (g->Npart == 0)
+			continue;
+
+		const int N = g->N;
+		const float size = g->Size;
+		const float rad = symmetric ? max(hsml, g->Hsml) : hsml;
+		const int r = rad / size + 1; // cells on each side
+		const int n = min(2*r + 1, N);
+		const bool prune = (2*r + 1 <= N); // else images are ambiguous
+
+		const int ci = cell_index(pos_i[0], N) - r;
+		const int cj = cell_index(pos_i[1], N) - r;
+		const int ck = cell_index(pos_i[2], N) - r;
+
+		for (int i = 0; i < n; i++) {
+
+			const float dx = prune * cell_distance(pos_i[0], ci + i, size);
+
+			if (dx*dx > rad*rad)
+				continue;
+
+			for (int j = 0; j < n; j++) {
+
+				const float dy = prune * cell_distance(pos_i[1], cj + j, size);
+
+				if (dx*dx + dy*dy > rad*rad)
+					continue;
+
+				for (int k = 0; k < n; k++) {
+
+					const float dz = prune * cell_distance(pos_i[2], ck+k, size);
+
+					if (dx*dx + dy*dy + dz*dz > rad*rad)
+						continue;
+
+					const int cell = (((ci+i + N*r) % N) * N + (cj+j + N*r) % N)
+						* N + (ck+k + N*r) % N;
+
+					if (symmetric && prune && dx*dx + dy*dy + dz*dz 
+							> p2(max(hsml, g->Hsml_Max[cell])))
+						continue;
+
+					ngbcnt = cell_ngb(ipart, hsml, cell, g, ngbcnt, ngblist,
+							symmetric);
+
+					if (ngbcnt == NGBMAX)
+						return ngbcnt;
+				}
+			}
+		}
+	}
+
+	return ngbcnt;
+}
+
+/*
+ * Add the particles of a cell closer than hsml to ngblist, branch free like 
+ * the leaves of the tree. Stops before ngblist overflows.
+ */
+
+static inline int cell_ngb(const int ipart, const float hsml, const int cell,
+		const struct Cell_Grid *g, int ngbcnt, int ngblist[NGBMAX], 
+		const bool symmetric)
+{
+	const float boxsize = Param.Boxsize;
+	const float pos_i[3] = {P[ipart].Pos[0],P[ipart].Pos[1],P[ipart].Pos[2]};
+
+	const int first = g->First[cell];
+	const int last = g->First[cell + 1];
+
+	TREE_STAT(Nodes_Opened, 1);
+	TREE_STAT(Parts_Tested, last - first);
+
+	for (int m = first; m < last; m++) {
+
+		if (ngbcnt == NGBMAX)
+			break;
+
+		float dx = fabsf(pos_i[0] - Cell_Pos[0][m]);
+		float dy = fabsf(pos_i[1] - Cell_Pos[1][m]);
+		float dz = fabsf(pos_i[2] - Cell_Pos[2][m]);
+
+		dx = min(dx, boxsize - dx);
+		dy = min(dy, boxsize - dy);
+		dz = min(dz, boxsize - dz);
+
+		const float h = symmetric ? max(hsml, Cell_Hsml[m]) : hsml;
+
+		ngblist[ngbcnt] = Cell_Part[m];
+
+		ngbcnt += dx*dx + dy*dy + dz*dz < h*h;
+	}
+
+	return ngbcnt;
+}
+
+static inline float cell_hsml(const int ipart, const float *hsml,
+		const float scale)
+{
+	float h = (hsml == NULL) ? SphP[ipart].Hsml : hsml[ipart] * scale;
+
+	if (h <= 0)
+		h = Guess_hsml(ipart, DESNNGB);
+
+	return h;
+}
+
+/*
+ * Distance of x to cell idx along one axis, idx may be outside of [0,N) 
+ */
+
+static inline float cell_distance(const float x, const int idx, 
+		const float size)
+{
+	return max(0, max(idx*size - x, x - (idx+1)*size));
+}
+
+static inline int cell_index(const float x, const int N)
+{
+	const int i = x / Param.Boxsize * N;
+
+	return max(0, min(N - 1, i));
+}
@@ -44,19 +44,9 @@
 #define CHARBUFSIZE 512        // For any char buffer !
 #define MAXTAGS 300            // In parameter file
 
-#ifdef SPH_CUBIC_SPLINE
-
-#define DESNNGB  50        // SPH kernel weighted number of neighbours
-#define NNGBDEV 0.05       // error tolerance in SPH kernel weighted neighb.
-#define NGBMAX (DESNNGB*8)  // size of neighbour list
-
-#else
-
-#define DESNNGB  295        // SPH kernel weighted number of neighbours
+#define DESNNGB (Kernel.DesNngb) // SPH kernel weighted number of neighbours
 #define NNGBDEV 0.05       // error tolerance in SPH kernel weighted neighb.
-#define NGBMAX (DESNNGB*8)  // size of neighbour list
-
-#endif // SPH_CUBIC_SPLINE
+#define NGBMAX 2400        // size of neighbour list, >= 8*DESNNGB
 
 
 #define R200_TO_RMAX_RATIO 3.75 // this fits Y_M500 correlation
@@ -117,6 +107,10 @@ extern struct Parameters{
     int Nhalos;                     // Number of halos, incl. substructure
     double GravSofteningLength;
     double Zero_Energy_Orbit_Fraction;
+    int Ngb_Finder;                 // 0 tree, 1 cell grid
+    int Sph_Desnngb;                // 0 for the default of the kernel
+    int Ngb_Cache_MB;               // neighbour cache size, 0 off
+    int Sph_Hsml_Batch;             // 1 solve hsml in batches of particles
 #ifdef ADD_THIRD_SUBHALO
     double SubFirstMass;
     double SubFirstPos[3];
@@ -133,6 +127,15 @@ extern struct Parameters{
 #endif
 } Param;
 
+extern struct Kernel_Properties { // set from the parameter file
+    int Type;                       // KERNEL_M4, _WC2, _WC4, _WC6 in kernel.h
+    char Name[CHARBUFSIZE];
+    double Norm;                    // W(r,h) = Norm/h^3 w(r/h)
+    int DesNngb;                    // kernel weighted number of neighbours
+    double Bias_Eps;                // density bias correction (Dehnen+ 12)
+    double Bias_Alpha;
+} Kernel;
+
 extern struct SubhaloData {
     int First;
     int Ntotal;
@@ -193,8 +196,71 @@ extern struct GasParticleData {
     float ID;
     float Rho_Model;
     float Rs[3];
+#ifdef OUTPUT_DIVB
+    float DivB;                     // SPH estimate of div B
+#endif
 } *SphP;
 
+extern struct DMParticleData { // Npart[1] long, same order as the DM in P
+    float Rho;
+    float Hsml;
+} *DMP;
+
+extern struct GravityData { // Ntotal long, same order as P
+    float Pot;
+    float Acc[3];
+} *GravP;
+
+struct Leaf_Pairs { // interaction lists of the tree leaves, Find_leaf_pairs()
+    int NLeaves;
+    int *First;                   // first particle of a leaf
+    int *Npart;                   // number of particles in a leaf
+    int *Offset;                  // partners of a: Partner[Offset[a]...]
+    int *Partner;                 // leaves b >= a in reach of a
+    int NChunks;
+    int *Chunk;                   // leaves of chunk c: Chunk[c]...Chunk[c+1]-1
+    int NColours;
+    int *Colour_Offset;           // chunks of colour c: Colour_Chunk[...]
+    int *Colour_Chunk;
+};
+
+enum Cost_Passes { // particle loops with a cost model, load_balance.c
+    COST_HSML,
+    COST_DM_HSML,
+    COST_WVT,
+    COST_BFLD,
+    COST_DIVB,
+    NCOST_PASSES
+};
+
+struct Work_Chunks { // particles of a loop in chunks of equal cost
+    int NChunks;
+    int *First;                   // chunk c: First[c]...First[c+1]-1
+};
+
+#ifdef TREE_STATISTICS
+extern struct Tree_Statistics { // per thread, since the last print
+    long long Queries;            // neighbour searches
+    long long Nodes_Opened;       // nodes overlapping the search sphere
+    long long Parts_Tested;       // particle distances computed
+    long long Ngbs_Found;         // neighbours returned
+    long long Retry_Ngbmax;       // hsml decreased after a full ngblist
+    long long Retry_Desnngb;      // hsml increased, less than DESNNGB ngbs
+    long long Count_Queries;      // count-only queries, Find_ngb_weight()
+    long long Hsml_Parts;         // particles in the hsml solver
+    long long Hsml_Walks;         // neighbour searches of the hsml solver
+    long long Hsml_Solves;        // calls of Find_hsml
+    long long Newton_Its;         // Newton Raphson steps in Find_hsml
+    long long Bisection_Its;      // bisection steps in Find_hsml
+} Tree_Stats;
+#pragma omp threadprivate(Tree_Stats)
+
+#define TREE_STAT(field, n) (Tree_Stats.field += (n))
+
+#else
+#define TREE_STAT(field, n) // compiled out
+#endif // TREE_STATISTICS
+
 /* code units */
 extern struct Units{
     double Length;
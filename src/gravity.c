@@ -0,0 +1,63 @@
+#include "globals.h"
+#include "tree.h"
+
+/*
+ * Tree potential and acceleration of all particles, to check the equilibrium
+ * of the ICs without a simulation. The tree holds one particle type, so we
+ * build one tree per type and add up the walks. All types are Peano sorted
+ * first, so the Halo DM pointers are invalid afterwards.
+ */
+
+void Find_gravity()
+{
+	const double eps = Param.GravSofteningLength;
+	const int ntot = Param.Ntotal;
+
+	printf("Tree gravity, softening %g kpc ", eps*Unit.Length/kpc2cgs);
+	fflush(stdout);
+
+	GravP = Realloc(GravP, ntot * sizeof(*GravP));
+
+	memset(GravP, 0, ntot * sizeof(*GravP));
+
+	for (int type = 0; type < 6; type++)
+		if (Param.Npart[type] > 0)
+			Sort_Type_By_Peano_Key(type);
+
+	for (int type = 0; type < 6; type++) {
+
+		if (Param.Npart[type] == 0)
+			continue;
+
+		Build_Tree_Type(type);
+
+		Set_tree_moments();
+
+		#pragma omp parallel for schedule(dynamic, ntot/Omp.NThreads/64+1)
+		for (int ipart = 0; ipart < ntot; ipart++)
+			Gravity_tree(ipart, eps, &GravP[ipart].Pot, GravP[ipart].Acc);
+	}
+
+	double epot = 0, ekin = 0, etherm = 0; // virial check
+
+	#pragma omp parallel for reduction(+:epot,ekin)
+	for (int ipart = 0; ipart < ntot; ipart++) {
+
+		const double mpart = Param.Mpart[P[ipart].Type];
+
+		epot += 0.5 * mpart * GravP[ipart].Pot;
+		ekin += 0.5 * mpart * (p2(P[ipart].Vel[0]) + p2(P[ipart].Vel[1])
+				+ p2(P[ipart].Vel[2]));
+	}
+
+	#pragma omp parallel for reduction(+:etherm)
+	for (int ipart = 0; ipart < Param.Npart[0]; ipart++)
+		etherm += Param.Mpart[0] * SphP[ipart].U;
+
+	printf("done \n"
+			"   Epot = %g, Ekin = %g, Etherm = %g \n"
+			"   2 (Ekin+Etherm) / |Epot| = %g (includes the merger orbit) \n\n",
+			epot, ekin, etherm, 2*(ekin+etherm)/fabs(epot));
+
+	return ;
+}
@@ -165,6 +165,28 @@ void fill_write_buffer(enum iofields blocknr, void *wbuf,
             for (i=0; i<3; i++)
                 ((float *)wbuf)[ibuf+i] = SphP[ipart].Bfld[i];
         break;
+#ifdef OUTPUT_DM_DENSITY
+        case IO_DM_RHO: // DM only blocks, ipart counts from 0
+            ((float *)wbuf)[ibuf] = DMP[ipart].Rho;
+        break;
+        case IO_DM_HSML:
+            ((float *)wbuf)[ibuf] = DMP[ipart].Hsml;
+        break;
+#endif
+#ifdef OUTPUT_GRAVITY
+        case IO_POT:
+            ((float *)wbuf)[ibuf] = GravP[ipart].Pot;
+        break;
+        case IO_ACCEL:
+            for (i=0; i<3; i++)
+                ((float *)wbuf)[ibuf+i] = GravP[ipart].Acc[i];
+        break;
+#endif
+#ifdef OUTPUT_DIVB
+        case IO_DIVB:
+            ((float *)wbuf)[ibuf] = SphP[ipart].DivB;
+        break;
+#endif
         default:
             Assert(0, "Block not found %d",blocknr);
         break;
@@ -243,6 +265,49 @@ void set_block_info(enum iofields blocknr)
         Block.Val_per_element = 3;
         Block.Bytes_per_element = sizeof(SphP[0].Bfld[0]);
         break;
+#ifdef OUTPUT_DM_DENSITY
+        case IO_DM_RHO:
+        strncpy(Block.Label,"RHDM",4);
+        strncpy(Block.Name, "DMDensity",16);
+        Block.Npart[1] = Param.Npart[1];
+        Block.Val_per_element = 1;
+        Block.Bytes_per_element = sizeof(DMP[0].Rho);
+        break;
+        case IO_DM_HSML:
+        strncpy(Block.Label,"HSDM",4);
+        strncpy(Block.Name, "DMSmoothingLength",18);
+        Block.Npart[1] = Param.Npart[1];
+        Block.Val_per_element = 1;
+        Block.Bytes_per_element = sizeof(DMP[0].Hsml);
+        break;
+#endif
+#ifdef OUTPUT_GRAVITY
+        case IO_POT:
+        strncpy(Block.Label,"POT ",4);
+        strncpy(Block.Name, "Potential",16);
+        for (i=0; i<6; i++)
+            Block.Npart[i] = Param.Npart[i];
+        Block.Val_per_element = 1;
+        Block.Bytes_per_element = sizeof(GravP[0].Pot);
+        break;
+        case IO_ACCEL:
+        strncpy(Block.Label,"ACCE",4);
+        strncpy(Block.Name, "Acceleration",16);
+        for (i=0; i<6; i++)
+            Block.Npart[i] = Param.Npart[i];
+        Block.Val_per_element = 3;
+        Block.Bytes_per_element = sizeof(GravP[0].Acc[0]);
+        break;
+#endif
+#ifdef OUTPUT_DIVB
+        case IO_DIVB:
+        strncpy(Block.Label,"DIVB",4);
+        strncpy(Block.Name, "DivergenceOfB",16);
+        Block.Npart[0] = Param.Npart[0];
+        Block.Val_per_element = 1;
+        Block.Bytes_per_element = sizeof(SphP[0].DivB);
+        break;
+#endif
         case IO_LASTENTRY:
         strncpy(Block.Label,"LAST",4);
         strncpy(Block.Name, " ",1);
@@ -372,6 +437,26 @@ void Read_param_file(char *filename)
     addr[nt] = &Halo[1].Rcut_R200_Ratio;
     id[nt++] = REAL;
 
+    strcpy(tag[nt], "NgbFinder");
+    addr[nt] = &Param.Ngb_Finder;
+    id[nt++] = INT;
+
+    strcpy(tag[nt], "SphKernel");
+    addr[nt] = &Kernel.Name;
+    id[nt++] = STRING;
+
+    strcpy(tag[nt], "SphDesNngb");
+    addr[nt] = &Param.Sph_Desnngb;
+    id[nt++] = INT;
+
+    strcpy(tag[nt], "NgbCacheMB");
+    addr[nt] = &Param.Ngb_Cache_MB;
+    id[nt++] = INT;
+
+    strcpy(tag[nt], "SphHsmlBatch");
+    addr[nt] = &Param.Sph_Hsml_Batch;
+    id[nt++] = INT;
+
     /* System of Units */
     strcpy(tag[nt], "UnitLength_in_cm");
     addr[nt] = &Unit.Length;
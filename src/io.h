@@ -37,6 +37,17 @@ enum iofields{
     IO_HSML,
     IO_BFLD,
 	IO_RHOMODEL,
+#ifdef OUTPUT_DM_DENSITY
+	IO_DM_RHO,
+	IO_DM_HSML,
+#endif
+#ifdef OUTPUT_GRAVITY
+	IO_POT,
+	IO_ACCEL,
+#endif
+#ifdef OUTPUT_DIVB
+	IO_DIVB,
+#endif
     IO_LASTENTRY
 };
 
@@ -0,0 +1,325 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+/*
+ * The SPH kernel family, selected with the SphKernel parameter, see
+ * Set_kernel(). With u = r/h <= 1 a kernel is W(r,h) = Kernel.Norm/h^3 w(u),
+ * here we evaluate w(u) and u dw/du, all kernels have w(0) = 1.
+ * The kernel type is a template parameter: The functions below are always
+ * inlined, so with a constant type the switch folds away. Hot loops are
+ * written the same way and instantiated once per kernel with
+ * KERNEL_SPECIALISE, there is no dispatch per pair.
+ */
+
+enum Kernel_Types {
+	KERNEL_M4, 			// cubic spline, for use with Gadget2
+	KERNEL_WC2, 		// Wendland C2 (Dehnen & Aly 12)
+	KERNEL_WC4,			// Wendland C4
+	KERNEL_WC6, 		// Wendland C6
+	NKERNELS
+};
+
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+#define KERNEL_BATCH 8 // particles of kernel_sums_batch(), one AVX vector
+
+#define KERNEL_SPECIALISE(func, ...) 							\
+	switch (Kernel.Type) { 										\
+	case KERNEL_M4: 	func(KERNEL_M4, __VA_ARGS__); break; 	\
+	case KERNEL_WC2: 	func(KERNEL_WC2, __VA_ARGS__); break; 	\
+	case KERNEL_WC4: 	func(KERNEL_WC4, __VA_ARGS__); break; 	\
+	default: 			func(KERNEL_WC6, __VA_ARGS__); break; 	\
+	}
+
+KERNEL_INLINE void kernel_poly(const int type, const float u, float *wk,
+		float *dwk)
+{
+	const float t = 1 - u;
+	const float t2 = t * t;
+
+	switch (type) {
+
+	case KERNEL_M4:
+
+		if (u < 0.5f) {
+
+			*wk = 1 + 6 * u * u * (u - 1);
+			*dwk = 6 * u * u * (3 * u - 2);
+
+		} else {
+
+			*wk = 2 * t2 * t;
+			*dwk = -6 * u * t2;
+		}
+
+		break;
+
+	case KERNEL_WC2:
+
+		*wk = t2 * t2 * (1 + 4 * u);
+		*dwk = -20 * u * u * t2 * t;
+
+		break;
+
+	case KERNEL_WC4: {
+
+		const float t5 = t2 * t2 * t;
+
+		*wk = t5 * t * (1 + u * (6 + 35/3.0f * u));
+		*dwk = -56/3.0f * u * u * t5 * (1 + 5 * u);
+
+		break;
+	}
+
+	default: { // KERNEL_WC6
+
+		const float t7 = t2 * t2 * t2 * t;
+
+		*wk = t7 * t * (1 + u * (8 + u * (25 + 32 * u)));
+		*dwk = -22 * t7 * u * u * (1 + u * (7 + 16 * u));
+
+		break;
+	}
+	}
+
+	return ;
+}
+
+#ifdef __AVX__
+KERNEL_INLINE __m256 madd(const __m256 a, const __m256 b, const __m256 add)
+{
+#ifdef __FMA__
+	return _mm256_fmadd_ps(a, b, add);
+#else
+	return _mm256_add_ps(_mm256_mul_ps(a, b), add);
+#endif
+}
+
+/*
+ * kernel_poly() for eight u, polynomials in Horner form with fused
+ * multiply-add if available. The cubic spline evaluates both branches.
+ */
+
+KERNEL_INLINE void kernel_poly_avx(const int type, const __m256 u,
+		__m256 *wk, __m256 *dwk)
+{
+	const __m256 t = _mm256_sub_ps(_mm256_set1_ps(1), u);
+	const __m256 u2 = _mm256_mul_ps(u, u);
+	const __m256 t2 = _mm256_mul_ps(t, t);
+
+	switch (type) {
+
+	case KERNEL_M4: {
+
+		const __m256 inner = _mm256_cmp_ps(u, _mm256_set1_ps(0.5),
+				_CMP_LT_OQ);
+
+		const __m256 wk_in = madd(_mm256_set1_ps(6),
+				_mm256_mul_ps(u2, _mm256_sub_ps(u, _mm256_set1_ps(1))),
+				_mm256_set1_ps(1));
+		const __m256 wk_out = _mm256_mul_ps(_mm256_set1_ps(2),
+				_mm256_mul_ps(t2, t));
+
+		const __m256 dwk_in = _mm256_mul_ps(u2, madd(_mm256_set1_ps(18), u,
+					_mm256_set1_ps(-12)));
+		const __m256 dwk_out = _mm256_mul_ps(_mm256_set1_ps(-6),
+				_mm256_mul_ps(u, t2));
+
+		*wk = _mm256_blendv_ps(wk_out, wk_in, inner);
+		*dwk = _mm256_blendv_ps(dwk_out, dwk_in, inner);
+
+		break;
+	}
+
+	case KERNEL_WC2: {
+
+		const __m256 t3 = _mm256_mul_ps(t2, t);
+
+		*wk = _mm256_mul_ps(_mm256_mul_ps(t3, t),
+				madd(_mm256_set1_ps(4), u, _mm256_set1_ps(1)));
+		*dwk = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(-20), u2), t3);
+
+		break;
+	}
+
+	case KERNEL_WC4: {
+
+		const __m256 t5 = _mm256_mul_ps(_mm256_mul_ps(t2, t2), t);
+
+		__m256 p = madd(_mm256_set1_ps(35/3.0f), u, _mm256_set1_ps(6));
+		p = madd(p, u, _mm256_set1_ps(1));
+
+		const __m256 q = madd(_mm256_set1_ps(5), u, _mm256_set1_ps(1));
+
+		*wk = _mm256_mul_ps(_mm256_mul_ps(t5, t), p);
+		*dwk = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(-56/3.0f), t5),
+				_mm256_mul_ps(u2, q));
+
+		break;
+	}
+
+	default: { // KERNEL_WC6
+
+		const __m256 t4 = _mm256_mul_ps(t2, t2);
+		const __m256 t7 = _mm256_mul_ps(_mm256_mul_ps(t4, t2), t);
+
+		__m256 p = madd(_mm256_set1_ps(32), u, _mm256_set1_ps(25));
+		p = madd(p, u, _mm256_set1_ps(8));
+		p = madd(p, u, _mm256_set1_ps(1));
+
+		__m256 q = madd(_mm256_set1_ps(16), u, _mm256_set1_ps(7));
+		q = madd(q, u, _mm256_set1_ps(1));
+
+		*wk = _mm256_mul_ps(_mm256_mul_ps(t7, t), p);
+		*dwk = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(-22), t7),
+				_mm256_mul_ps(u2, q));
+
+		break;
+	}
+	}
+
+	return ;
+}
+#endif // __AVX__
+
+/*
+ * Kernel sums over the neighbours with r^2 <= hsml^2 in units of hsml:
+ * sum_wk = sum w(u) and sum_dwk = sum u dw/du, with u = r/h. AVX evaluates
+ * eight neighbours at once, outside the kernel the lanes are masked out.
+ */
+
+KERNEL_INLINE void kernel_sums(const int type, const float *r2, const int n,
+		const float hsml, double *sum_wk, double *sum_dwk)
+{
+	const float h2 = hsml * hsml;
+	const float h_inv = 1 / hsml;
+
+	int i = 0;
+
+#ifdef __AVX__
+	__m256 wk_sum = _mm256_setzero_ps();
+	__m256 dwk_sum = _mm256_setzero_ps();
+
+	for (; i + 8 <= n; i += 8) {
+
+		const __m256 d2 = _mm256_loadu_ps(&r2[i]);
+
+		const __m256 inside = _mm256_cmp_ps(d2, _mm256_set1_ps(h2), 
+				_CMP_LE_OQ);
+
+		__m256 u = _mm256_mul_ps(_mm256_sqrt_ps(d2), _mm256_set1_ps(h_inv));
+
+		u = _mm256_min_ps(u, _mm256_set1_ps(1));
+
+		__m256 wk, dwk;
+
+		kernel_poly_avx(type, u, &wk, &dwk);
+
+		wk_sum = _mm256_add_ps(wk_sum, _mm256_and_ps(inside, wk));
+		dwk_sum = _mm256_add_ps(dwk_sum, _mm256_and_ps(inside, dwk));
+	}
+
+	float wk_lane[8], dwk_lane[8];
+
+	_mm256_storeu_ps(wk_lane, wk_sum);
+	_mm256_storeu_ps(dwk_lane, dwk_sum);
+
+	for (int k = 0; k < 8; k++) {
+
+		*sum_wk += wk_lane[k];
+		*sum_dwk += dwk_lane[k];
+	}
+#endif // __AVX__
+
+	for (; i < n; i++) {
+
+		if (r2[i] > h2)
+			continue;
+
+		float wk, dwk;
+
+		kernel_poly(type, sqrtf(r2[i]) * h_inv, &wk, &dwk);
+
+		*sum_wk += wk;
+		*sum_dwk += dwk;
+	}
+
+	return ;
+}
+
+/*
+ * kernel_sums() of KERNEL_BATCH particles at once, SIMD across particles:
+ * Row i of r2 holds the squared separation of every particle to its i-th 
+ * neighbour, lanes with fewer neighbours are padded with r2 beyond hsml.
+ */
+
+KERNEL_INLINE void kernel_sums_batch(const int type, 
+		const float (*r2)[KERNEL_BATCH], const int n, const float *hsml,
+		double *sum_wk, double *sum_dwk)
+{
+#ifdef __AVX__
+	const __m256 h = _mm256_loadu_ps(hsml);
+	const __m256 h2 = _mm256_mul_ps(h, h);
+	const __m256 h_inv = _mm256_div_ps(_mm256_set1_ps(1), h);
+
+	__m256 wk_sum = _mm256_setzero_ps();
+	__m256 dwk_sum = _mm256_setzero_ps();
+
+	for (int i = 0; i < n; i++) {
+
+		const __m256 d2 = _mm256_loadu_ps(r2[i]);
+
+		const __m256 inside = _mm256_cmp_ps(d2, h2, _CMP_LE_OQ);
+
+		__m256 u = _mm256_mul_ps(_mm256_sqrt_ps(d2), h_inv);
+
+		u = _mm256_min_ps(u, _mm256_set1_ps(1));
+
+		__m256 wk, dwk;
+
+		kernel_poly_avx(type, u, &wk, &dwk);
+
+		wk_sum = _mm256_add_ps(wk_sum, _mm256_and_ps(inside, wk));
+		dwk_sum = _mm256_add_ps(dwk_sum, _mm256_and_ps(inside, dwk));
+	}
+
+	float wk_lane[8], dwk_lane[8];
+
+	_mm256_storeu_ps(wk_lane, wk_sum);
+	_mm256_storeu_ps(dwk_lane, dwk_sum);
+#else
+	float wk_lane[KERNEL_BATCH] = { 0 }, dwk_lane[KERNEL_BATCH] = { 0 };
+
+	for (int i = 0; i < n; i++) {
+
+		#pragma omp simd
+		for (int k = 0; k < KERNEL_BATCH; k++) {
+
+			float u = fminf(sqrtf(r2[i][k]) / hsml[k], 1);
+
+			float wk, dwk;
+
+			kernel_poly(type, u, &wk, &dwk);
+
+			const bool inside = r2[i][k] <= hsml[k] * hsml[k];
+
+			wk_lane[k] += inside ? wk : 0;
+			dwk_lane[k] += inside ? dwk : 0;
+		}
+	}
+#endif // __AVX__
+
+	for (int k = 0; k < KERNEL_BATCH; k++) {
+
+		sum_wk[k] = wk_lane[k];
+		sum_dwk[k] = dwk_lane[k];
+	}
+
+	return ;
+}
+
+#endif // KERNEL_H
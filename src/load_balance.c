@@ -0,0 +1,144 @@
+#include "globals.h"
+
+#define CHUNK_FRAC 2	// chunk cost is remaining cost / CHUNK_FRAC / NThreads
+#define MIN_CHUNK_FRAC 64 // but at least total cost / MIN_CHUNK_FRAC / NThreads
+
+/*
+ * Cost model for the parallel particle loops. A loop records the cost of
+ * every particle, i.e. the neighbour candidates it tested, with Set_cost().
+ * Before the next run of the same loop Balance_work() cuts the particles
+ * into chunks along the prefix sum of the recorded costs. Like a guided
+ * schedule, but in cost instead of particles: The first chunks are large,
+ * their cost shrinks with the remaining cost, so the last chunks are small
+ * and the threads finish together. The particles are Peano ordered, so a 
+ * chunk is a compact volume and a dense core gets short chunks, the 
+ * outskirts long ones. Threads take the chunks dynamically, which absorbs 
+ * the error of the model. Without a record all particles cost the same.
+ * The threads add up their busy time per loop, Print_load_balance() shows
+ * the balance.
+ */
+
+static const char *Pass_Names[NCOST_PASSES] = { "hsml", "DM hsml", "wvt",
+	"bfld", "div B" };
+
+static struct Cost_Model {
+	int Npart;				// particles with a recorded cost
+	float *Cost;			// of the particles in the last run
+	struct Work_Chunks Work;
+	double *Busy;			// time per thread since the last print
+} Model[NCOST_PASSES] = { 0 };
+
+/*
+ * Chunks of decreasing recorded cost for npart particles of a loop. With a
+ * changed number of particles the record starts again at unit cost.
+ */
+
+const struct Work_Chunks *Balance_work(const int pass, const int npart)
+{
+	struct Cost_Model *m = &Model[pass];
+
+	if (m->Npart != npart) {
+
+		m->Cost = Realloc(m->Cost, max(1, npart) * sizeof(*m->Cost));
+
+		for (int ipart = 0; ipart < npart; ipart++)
+			m->Cost[ipart] = 1;
+
+		m->Npart = npart;
+	}
+
+	if (m->Busy == NULL) {
+
+		m->Busy = Malloc(Omp.NThreads * sizeof(*m->Busy));
+
+		memset(m->Busy, 0, Omp.NThreads * sizeof(*m->Busy));
+	}
+
+	double total = 0;
+
+	for (int ipart = 0; ipart < npart; ipart++)
+		total += m->Cost[ipart];
+
+	const double min_cost = total / MIN_CHUNK_FRAC / Omp.NThreads;
+
+	const int max_chunks = MIN_CHUNK_FRAC * Omp.NThreads + 2; // >= min_cost
+
+	m->Work.First = Realloc(m->Work.First,
+			(max_chunks + 1) * sizeof(*m->Work.First));
+
+	double sum = 0; // prefix sum of the cost
+	double next = 0; // start the next chunk at this cost
+	int chunk = 0;
+
+	for (int ipart = 0; ipart < npart; ipart++) {
+
+		if (sum >= next && chunk < max_chunks) {
+
+			m->Work.First[chunk++] = ipart;
+
+			next = sum + fmax(min_cost, (total-sum)/CHUNK_FRAC/Omp.NThreads);
+		}
+
+		sum += m->Cost[ipart];
+	}
+
+	m->Work.NChunks = chunk;
+	m->Work.First[chunk] = npart;
+
+	return &m->Work;
+}
+
+/*
+ * Record the cost of ipart in this run of the loop, thread safe if every
+ * particle is done by one thread.
+ */
+
+void Set_cost(const int pass, const int ipart, const float cost)
+{
+	Model[pass].Cost[ipart] = cost;
+
+	return ;
+}
+
+void Add_busy_time(const int pass, const double time)
+{
+	Model[pass].Busy[Omp.ThreadID] += time;
+
+	return ;
+}
+
+/*
+ * Busy time of the threads per loop since the last print. The imbalance
+ * max/mean is the wall time of the loop over its time with perfect balance.
+ */
+
+void Print_load_balance()
+{
+	for (int pass = 0; pass < NCOST_PASSES; pass++) {
+
+		const double *busy = Model[pass].Busy;
+
+		if (busy == NULL)
+			continue;
+
+		double b_min = busy[0], b_max = 0, b_mean = 0;
+
+		for (int i = 0; i < Omp.NThreads; i++) {
+
+			b_min = fmin(b_min, busy[i]);
+			b_max = fmax(b_max, busy[i]);
+			b_mean += busy[i] / Omp.NThreads;
+		}
+
+		if (b_max == 0)
+			continue;
+
+		printf("          Busy time %s: min=%gs; mean=%gs; max=%gs; "
+				"imbalance=%g\n", Pass_Names[pass], b_min, b_mean, b_max,
+				b_max/b_mean);
+
+		memset(Model[pass].Busy, 0, Omp.NThreads * sizeof(*busy));
+	}
+
+	return ;
+}
@@ -27,6 +27,12 @@ void Make_magnetic_field()
 
  	normalise_magnetic_field();
 
+#ifdef OUTPUT_DIVB
+	Find_sph_divB(); // needs the final B of the neighbours
+#endif
+
+	Print_load_balance();
+
     return;
 }
 
@@ -70,34 +76,37 @@ static void set_magnetic_vector_potential()
 
     return ;  
 }
-/* Normalise BFLD inside 0.8 rc of halo 0 */
+/* Normalise BFLD inside 0.8 rc of halo 0, found with the gas tree */
 
 static void normalise_magnetic_field() // doesnt work correctly
 {
 	const float boxhalf = 0.5 * Param.Boxsize;
 
- 	double mean_B = 0; // in 0.8rc of Halo[0]
-	uint64_t cnt = 0;
+	const float centre[3] = { Halo[0].D_CoM[0] + boxhalf, 
+							  Halo[0].D_CoM[1] + boxhalf, 
+							  Halo[0].D_CoM[2] + boxhalf };
 
-	#pragma omp parallel for reduction(+:mean_B,cnt)
-	for (size_t ipart = 0; ipart < Halo[0].Npart[0]; ipart++) {
-		
-		double dx = P[ipart].Pos[0] - Halo[0].D_CoM[0] - boxhalf,
-			   dy = P[ipart].Pos[1] - Halo[0].D_CoM[1] - boxhalf,
-			   dz = P[ipart].Pos[2] - Halo[0].D_CoM[2] - boxhalf;
+	int *ball = NULL;
 
-		double r = sqrt(dx*dx + dy*dy + dz*dz);
+	uint64_t cnt = Find_ball_tree(centre, 0.8*Halo[0].Rcore, &ball);
 
-		if (r > 0.8*Halo[0].Rcore)
-			continue;
+	Assert(cnt > 0, "No gas particles in 0.8 rc of halo 0");
+
+ 	double mean_B = 0; // in 0.8rc of Halo[0]
+
+	#pragma omp parallel for reduction(+:mean_B)
+	for (size_t i = 0; i < cnt; i++) {
+		
+		const int ipart = ball[i];
 
 		double bfld = sqrt(p2(SphP[ipart].Bfld[0]) + p2(SphP[ipart].Bfld[1]) 
 						 + p2(SphP[ipart].Bfld[2]));
 
 		mean_B += bfld;
-		cnt++;
 	}
 
+	Free(ball);
+
 	mean_B /= cnt;
 
    	double norm = Param.Bfld_Norm/mean_B*sqrt(2);
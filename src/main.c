@@ -28,6 +28,8 @@ int main(int argc, char *argv[])
 
     Set_cosmology();
 
+    Set_kernel();
+
     Setup();
 
     Make_positions();
@@ -57,6 +59,14 @@ int main(int argc, char *argv[])
 
     Apply_kinematics();
 
+#ifdef OUTPUT_DM_DENSITY
+    Find_DM_density();
+#endif
+
+#ifdef OUTPUT_GRAVITY
+    Find_gravity();
+#endif
+
     Write_output();
 
     return EXIT_SUCCESS ;
@@ -0,0 +1,210 @@
+#include "globals.h"
+#include "tree.h"
+
+#define NGB_CACHE_MARGIN 1.05 // lists reach this factor beyond hsml
+#define NGB_CACHE_GUESS 2 // first guess of the list length in DESNNGB
+
+/*
+ * Neighbour cache of the gas. The hsml solve of Find_sph_quantities()
+ * stores the final neighbour list of every particle together with the
+ * squared separations. Later passes at the same positions read the list
+ * instead of walking the tree again, e.g. the next hsml solve or the
+ * magnetic field from rot(A). A list holds all neighbours closer than its
+ * radius, a little larger than the hsml of the solve. The lists are stored
+ * back to back in one array and take at most NgbCacheMB from the parameter
+ * file. If they do not fit, the cache stays empty and all passes walk the
+ * tree as before. The cache is invalid after particles move or change order.
+ */
+
+static struct Ngb_Cache {
+	bool Valid;			// lists match the particle positions
+	bool Filling;		// between Start_ngb_cache() and Finish_ngb_cache()
+	bool Overflow;		// lists did not fit
+	bool Disabled;		// between Disable_ngb_cache() and Enable_ngb_cache()
+	int Npart;			// gas particles in the cache
+	int Max_Part;		// allocated particles
+	size_t Nngb;		// neighbours stored, or requested on overflow
+	size_t Max_Ngb;		// allocated neighbours
+	size_t *Offset;		// list of ipart: Ngb[Offset[ipart]...]
+	int *Cnt;			// length of the list of ipart
+	float *Rad;			// radius of the list of ipart, 0 if none
+	int *Ngb;			// neighbours
+	float *R2;			// and their squared separations
+} Cache = { 0 };
+
+/*
+ * Prepare the cache for the lists of a hsml solve of npart gas particles.
+ * Valid lists are kept, the solve reads them and fills in only the
+ * particles it has to walk for.
+ */
+
+void Start_ngb_cache(const int npart)
+{
+	if (Param.Ngb_Cache_MB <= 0 || Cache.Disabled)
+		return;
+
+	if (Cache.Valid && Cache.Npart == npart)
+		return ;
+
+	const size_t part_bytes = sizeof(*Cache.Offset) + sizeof(*Cache.Cnt)
+		+ sizeof(*Cache.Rad);
+	const size_t ngb_bytes = sizeof(*Cache.Ngb) + sizeof(*Cache.R2);
+	const size_t max_bytes = (size_t) Param.Ngb_Cache_MB * 1024 * 1024;
+
+	Cache.Valid = false;
+
+	if (npart * part_bytes >= max_bytes)
+		return ;
+
+	if (npart > Cache.Max_Part) {
+
+		Cache.Max_Part = npart;
+
+		Cache.Offset = Realloc(Cache.Offset, npart * sizeof(*Cache.Offset));
+		Cache.Cnt = Realloc(Cache.Cnt, npart * sizeof(*Cache.Cnt));
+		Cache.Rad = Realloc(Cache.Rad, npart * sizeof(*Cache.Rad));
+	}
+
+	size_t max_ngb = (size_t) npart * NGB_CACHE_GUESS * DESNNGB;
+
+	if (Cache.Overflow) // we know better from the last fill
+		max_ngb = Cache.Nngb;
+
+	max_ngb = min(max_ngb, (max_bytes - npart * part_bytes) / ngb_bytes);
+
+	if (max_ngb > Cache.Max_Ngb) {
+
+		Cache.Max_Ngb = max_ngb;
+
+		Cache.Ngb = Realloc(Cache.Ngb, max_ngb * sizeof(*Cache.Ngb));
+		Cache.R2 = Realloc(Cache.R2, max_ngb * sizeof(*Cache.R2));
+	}
+
+	memset(Cache.Rad, 0, npart * sizeof(*Cache.Rad));
+
+	Cache.Npart = npart;
+	Cache.Nngb = 0;
+	Cache.Overflow = false;
+	Cache.Filling = true;
+
+	return ;
+}
+
+/*
+ * Store the neighbours of ipart closer than rad and NGB_CACHE_MARGIN*hsml.
+ * The list has to contain all particles closer than rad. Thread safe.
+ */
+
+void Add_ngb_cache(const int ipart, const float hsml, const float rad,
+		const int *ngblist, const float *r2, const int ngbcnt)
+{
+	if (!Cache.Filling || ipart >= Cache.Npart)
+		return ;
+
+	const float rad_c = min(rad, hsml * NGB_CACHE_MARGIN);
+
+	int ngb[NGBMAX];
+	float ngb_r2[NGBMAX];
+
+	int n = 0;
+
+	for (int i = 0; i < ngbcnt; i++) { // branch free like the tree leaves
+
+		ngb[n] = ngblist[i];
+		ngb_r2[n] = r2[i];
+
+		n += (r2[i] < rad_c*rad_c);
+	}
+
+	size_t first = 0;
+
+	#pragma omp atomic capture
+	{ first = Cache.Nngb; Cache.Nngb += n; }
+
+	if (first + n > Cache.Max_Ngb) {
+
+		Cache.Overflow = true;
+
+		return ;
+	}
+
+	memcpy(&Cache.Ngb[first], ngb, n * sizeof(*ngb));
+	memcpy(&Cache.R2[first], ngb_r2, n * sizeof(*ngb_r2));
+
+	Cache.Offset[ipart] = first;
+	Cache.Cnt[ipart] = n;
+	Cache.Rad[ipart] = rad_c;
+
+	return ;
+}
+
+/*
+ * End of the hsml solve, the lists are valid if they all fit.
+ */
+
+void Finish_ngb_cache()
+{
+	if (!Cache.Filling)
+		return ;
+
+	Cache.Filling = false;
+	Cache.Valid = !Cache.Overflow;
+
+	if (Cache.Overflow)
+		printf("   Neighbour cache needs %zu MB, NgbCacheMB=%d, walking "
+				"the tree \n", Cache.Nngb * (sizeof(*Cache.Ngb)
+				+ sizeof(*Cache.R2)) / 1024 / 1024, Param.Ngb_Cache_MB);
+
+	return ;
+}
+
+void Invalidate_ngb_cache()
+{
+	Cache.Valid = false;
+
+	return ;
+}
+
+/*
+ * No lists for passes where the particles move after every hsml solve,
+ * like the WVT relaxation. NgbCacheMB from the parameter file stays as is.
+ */
+
+void Disable_ngb_cache()
+{
+	Cache.Disabled = true;
+	Cache.Valid = false;
+
+	return ;
+}
+
+void Enable_ngb_cache()
+{
+	Cache.Disabled = false;
+
+	return ;
+}
+
+/*
+ * Copy the cached neighbours of ipart and their squared separations, the
+ * list contains all particles closer than *rad. Returns -1 if ipart is not
+ * cached, then the caller has to walk the tree.
+ */
+
+int Find_ngb_cache(const int ipart, int *ngblist, float *r2, float *rad)
+{
+	if (!Cache.Valid || ipart >= Cache.Npart || Cache.Rad[ipart] == 0)
+		return -1;
+
+	const size_t first = Cache.Offset[ipart];
+	const int ngbcnt = Cache.Cnt[ipart];
+
+	memcpy(ngblist, &Cache.Ngb[first], ngbcnt * sizeof(*ngblist));
+
+	if (r2 != NULL)
+		memcpy(r2, &Cache.R2[first], ngbcnt * sizeof(*r2));
+
+	*rad = Cache.Rad[ipart];
+
+	return ngbcnt;
+}
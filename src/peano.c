@@ -40,61 +40,92 @@ int compare_peanoKeys(const void * a, const void *b)
 
 static peanoKey *Keys = NULL;
 static size_t *Idx = NULL;
+static size_t Max_Keys = 0;
 peanoKey Peano_Key(const double x, const double y, const double z);
-static void reorder_particles();
+static void reorder_particles(const int first, const int npart, 
+		const bool is_gas);
 
 void Sort_Particles_By_Peano_Key()
+{
+	Sort_Type_By_Peano_Key(0);
+
+	return ;
+}
+
+/* 
+ * Sort the particles of one type, SphP moves with the gas particles. 
+ */
+
+void Sort_Type_By_Peano_Key(const int type)
 {
 	const double boxsize = Param.Boxsize;
 	
-	if (Keys == NULL)
-		Keys = malloc(Param.Npart[0] * sizeof(*Keys));
-	else
-		memset(Keys, 0, Param.Npart[0] * sizeof(*Keys));
-	
-	if (Idx == NULL)
-		Idx = malloc(Param.Npart[0] * sizeof(*Idx));
-	else 
-		memset(Idx, 0, Param.Npart[0] * sizeof(*Idx));
+	int first = 0;
+
+	for (int i = 0; i < type; i++)
+		first += Param.Npart[i];
+
+	const int npart = Param.Npart[type];
+
+	if (npart > Max_Keys) {
+
+		Max_Keys = npart;
+
+		Keys = Realloc(Keys, Max_Keys * sizeof(*Keys));
+		Idx = Realloc(Idx, Max_Keys * sizeof(*Idx));
+	}
+
+	memset(Keys, 0, npart * sizeof(*Keys));
+	memset(Idx, 0, npart * sizeof(*Idx));
 	
 	#pragma omp parallel for
-	for (int ipart = 0; ipart < Param.Npart[0]; ipart++) {
+	for (int i = 0; i < npart; i++) {
+
+		const int ipart = first + i;
 
 		double px = P[ipart].Pos[0] / boxsize;
 		double py = P[ipart].Pos[1] / boxsize;
 		double pz = P[ipart].Pos[2] / boxsize;
 		
-		P[ipart].Key = Keys[ipart] = Peano_Key(px, py, pz);
+		P[ipart].Key = Keys[i] = Peano_Key(px, py, pz);
 	}
 
-  	gsl_heapsort_index(Idx, Keys, Param.Npart[0], sizeof(*Keys), 
-						&compare_peanoKeys);
+  	gsl_heapsort_index(Idx, Keys, npart, sizeof(*Keys), &compare_peanoKeys);
 
-	reorder_particles();
+	reorder_particles(first, npart, type == 0);
 	
 	return ;
 }
 
 	
 
-static void reorder_particles()
+static void reorder_particles(const int first, const int npart, 
+		const bool is_gas)
 {
-	for (int i = 0; i < Param.Npart[0]; i++) {
+	struct ParticleData *p = &P[first];
+	struct GasParticleData *sphp = is_gas ? SphP : NULL;
+
+	for (int i = 0; i < npart; i++) {
 	
         if (Idx[i] == i)
             continue;
 
 		int dest = i;
 
-		struct ParticleData Ptmp = P[i];
-		struct GasParticleData Sphtmp = SphP[i];
+		struct ParticleData Ptmp = p[i];
+		struct GasParticleData Sphtmp = { 0 };
+		
+		if (is_gas)
+			Sphtmp = sphp[i];
 
 		int src = Idx[i];
 
         for (;;) {
 
-			P[dest] = P[src];
-			SphP[dest] = SphP[src];
+			p[dest] = p[src];
+
+			if (is_gas)
+				sphp[dest] = sphp[src];
 
 			Idx[dest] = dest;
 
@@ -106,8 +137,10 @@ static void reorder_particles()
                 break;
         }
 
-		P[dest] = Ptmp;
-		SphP[dest] = Sphtmp;
+		p[dest] = Ptmp;
+
+		if (is_gas)
+			sphp[dest] = Sphtmp;
 
 		Idx[dest] = dest;
 
@@ -3,6 +3,7 @@
 typedef __uint128_t peanoKey;
 
 void Sort_Particles_By_Peano_Key();
+void Sort_Type_By_Peano_Key(const int);
 peanoKey Peano_Key(const double, const double, const double);
 peanoKey Reversed_Peano_Key(const double, const double, const double);
 void test_peanokey();
@@ -276,6 +276,8 @@ void Reassign_particles_to_halos()
 
 	sort_particles(haloID, Param.Npart[0]);
 
+	Invalidate_ngb_cache(); // new particle order
+
 	Free(haloID);
 
 	Sub.Ntotal = Sub.Npart[1]; // update particle numbers
@@ -30,6 +30,7 @@ double Internal_Energy_Profile_Analytic(const int i, const double d);
 void Read_param_file(char *);
 void Set_units();
 void Set_cosmology();
+void Set_kernel();
 void Setup();
 void Make_positions();
 void Make_IDs();
@@ -39,12 +40,19 @@ void Make_velocities();
 void Make_temperatures();
 void Make_magnetic_field();
 void Find_sph_quantities();
+void Find_sph_quantities_using(const int ngb_finder, const int hsml_batch);
+void Find_sph_density();
+void Find_DM_density();
+void Find_gravity();
 void Apply_kinematics();
 void Show_mass_in_r200();
 void Wvt_relax();
 void Shift_particles();
 void Write_output();
 void Bfld_from_rotA_SPH();
+#ifdef OUTPUT_DIVB
+void Find_sph_divB();
+#endif
 void Bfld_from_turb_spectrum();
 void Shift_Origin();
 void Regularise_sph_particles();
@@ -52,6 +60,13 @@ void Show_mass_in_r200();
 void Setup_Substructure();
 void Reassign_particles_to_halos();
 void Smooth_SPH_quantities();
+void Invalidate_ngb_cache();
+void Disable_ngb_cache();
+void Enable_ngb_cache();
+const struct Work_Chunks *Balance_work(const int pass, const int npart);
+void Set_cost(const int pass, const int ipart, const float cost);
+void Add_busy_time(const int pass, const double time);
+void Print_load_balance();
 
 
 int Halo_containing(const int, const float,const float,const float);
@@ -1,337 +1,1119 @@
 #include "globals.h"
 #include "sph.h"
 #include "tree.h"
+#include "kernel.h"
 
 #define JUMPTOLERANCE (0.05)
+#define KNN_NGB (3*DESNNGB/2) // candidates for the first hsml solve
+#define HSML_SEARCH_FAC 1.1 // search radius over hsml estimate, ~1.33 DESNNGB
+#define HSML_BATCH_PARTS 64 // particles per solve_hsml_batch()
+
+static float *Density_Hsml = NULL; // tree hsml of Find_sph_density()
+
+struct Hsml_Iteration { // state of the hsml solve of a particle
+	double Hsml;
+	double Upper;			// bisection interval
+	double Lower;
+	double Rho;				// at Hsml, without bias correction
+	double DRhodHsml;
+	int It;
+};
+
+KERNEL_INLINE void leaf_pair_sums(const int type, const struct Leaf_Pairs *lp,
+		const int a, float *pos[3], const float *hsml, const float *hsml_inv,
+		float *sum_wk, float *sum_dwk);
+KERNEL_INLINE void density_rotA(const int type, const int ipart, 
+		const int *ngblist, const int ngbcnt, double *sum_wk, double *sum_dwk,
+		double rot[3]);
+#ifdef OUTPUT_DIVB
+KERNEL_INLINE void divB(const int type, const int ipart, const int *ngblist,
+		const int ngbcnt, double *div);
+#endif
+
+static int solve_hsml(const int ipart, const double mpart,
+		int (*find_ngb)(const int, const float, int*), float *hsml_out,
+		float *rho_out, float *dRhodHsml_out);
+static void solve_hsml_batch(const int first, const int n,
+		const double mpart, int (*find_ngb)(const int, const float, int*),
+		float *hsml_out, float *rho_out, float *dRhodHsml_out, int *cost);
+static void ngb_separations(const int ipart, const int *ngblist, 
+		const int ngbcnt, float *r2);
+static bool hsml_from_r2(const int ipart, const float *r2, const int ngbcnt,
+		const double mpart, float *dRhodHsml_out, float *hsml_out, 
+		float *rho_out);
+static struct Hsml_Iteration hsml_start(const double hsml);
+static int hsml_step(struct Hsml_Iteration *s, const double mpart,
+		const double sum_wk, const double sum_dwk);
+static bool hsml_finish(const struct Hsml_Iteration *s, const int status,
+		const double mpart, float *dRhodHsml_out, float *hsml_out,
+		float *rho_out);
+static void set_sph_density(const int ipart, const double hsml, 
+		const double sum_wk, const double sum_dwk);
+static int sph_ngb(const int ipart, const float hsml, int *ngblist);
+
+/*
+ * Select the SPH kernel by name. The default neighbour numbers give about
+ * the same resolution as the WC6 with 295 neighbours, the cubic spline is
+ * used with Gadget2 defaults. The density bias correction of the Wendland
+ * kernels is from Dehnen & Aly 2012, eq. 18.
+ */
+
+void Set_kernel()
+{
+	const struct Kernel_Properties kernels[NKERNELS] = {
+		[KERNEL_M4]  = { KERNEL_M4,  "M4",  8/pi, 		  50,  0, 		0 },
+		[KERNEL_WC2] = { KERNEL_WC2, "WC2", 21/(2*pi), 	  145, 0.0294,  0.977 },
+		[KERNEL_WC4] = { KERNEL_WC4, "WC4", 495/(32*pi),  215, 0.01342, 1.579 },
+		[KERNEL_WC6] = { KERNEL_WC6, "WC6", 1365/(64*pi), 295, 0.0116,  2.236 }
+	};
+
+	int type = 0;
+
+	while (type < NKERNELS && strcmp(Kernel.Name, kernels[type].Name) != 0)
+		type++;
+
+	Assert(type < NKERNELS, "Unknown SphKernel '%s', use M4, WC2, WC4 or WC6",
+			Kernel.Name);
+
+	Kernel = kernels[type];
+
+	if (Param.Sph_Desnngb > 0)
+		Kernel.DesNngb = Param.Sph_Desnngb;
+
+	Assert(8*DESNNGB <= NGBMAX, "SphDesNngb %d too large, max %d", DESNNGB,
+			NGBMAX/8);
+
+	printf("SPH kernel %s with %d neighbours \n\n", Kernel.Name, DESNNGB);
 
-static inline float sph_kernel_M4(const float r, const float h);
-static inline float sph_kernel_derivative_M4(const float r, const float h);
+	return ;
+}
 
-static inline float sph_kernel_WC6(const float r, const float h);
-static inline float sph_kernel_derivative_WC6(const float r, const float h);
+/*
+ * Density and hsml of the gas. The neighbours come from the tree or the cell
+ * grid, depending on the NgbFinder parameter. The tree has to be built anyway 
+ * for the nearest neighbours of a particle without hsml. The final lists go
+ * into the neighbour cache, a second pass at the same positions reads them.
+ * With SphHsmlBatch the particles are solved in batches, SIMD across them.
+ */
 
 extern void Find_sph_quantities() 
 {
-	#pragma omp parallel for shared(SphP, P) \
-        schedule(dynamic, Param.Npart[0]/Omp.NThreads/64)
-    for (size_t ipart = 0; ipart<Param.Npart[0]; ipart++) {  
-        
-		float hsml = SphP[ipart].Hsml;
+	Find_sph_quantities_using(Param.Ngb_Finder, Param.Sph_Hsml_Batch);
+
+	return ;
+}
+
+/*
+ * Find_sph_quantities() with the neighbour finder and hsml batching given,
+ * e.g. to compare them in the benchmark.
+ */
 
-        if (hsml == 0)
-            hsml = 2*Guess_hsml(ipart, DESNNGB); // always too large
+void Find_sph_quantities_using(const int ngb_finder, const int hsml_batch)
+{
+	int (*find_ngb)(const int, const float, int*) = &Find_ngb_group;
 
-		Assert(isfinite(hsml), "hsml not finite ipart=%d parent=%d \n", 
-				ipart, P[ipart].Tree_Parent);
+	if (ngb_finder == 1) {
 
-        float dRhodHsml = 0;
-        float rho = 0;
+		Build_Cells(NULL, 1); // bins from the last hsml
 
-		int it = 0;
-        
-		for (;;) {
+		find_ngb = &Find_ngb_cells;
+	}
+
+	Start_ngb_cache(Param.Npart[0]);
+
+	const struct Work_Chunks *wc = Balance_work(COST_HSML, Param.Npart[0]);
+
+	#pragma omp parallel for shared(SphP, P) schedule(dynamic, 1)
+	for (int chunk = 0; chunk < wc->NChunks; chunk++) {
+
+		double t0 = omp_get_wtime();
+
+		const int batch = hsml_batch ? HSML_BATCH_PARTS : 1;
+
+    	for (int first = wc->First[chunk]; first < wc->First[chunk+1];
+				first += batch) {
+
+			const int n = min(batch, wc->First[chunk+1] - first);
+
+			float hsml[HSML_BATCH_PARTS], rho[HSML_BATCH_PARTS] = { 0 },
+				  dRhodHsml[HSML_BATCH_PARTS] = { 0 };
+			int cost[HSML_BATCH_PARTS];
+
+			for (int i = 0; i < n; i++)
+				hsml[i] = SphP[first + i].Hsml;
+
+			if (n == 1)
+				cost[0] = solve_hsml(first, Param.Mpart[0], find_ngb, hsml, rho,
+						dRhodHsml);
+			else
+				solve_hsml_batch(first, n, Param.Mpart[0], find_ngb, hsml, rho,
+						dRhodHsml, cost);
+
+			for (int i = 0; i < n; i++) {
+
+				const int ipart = first + i;
+
+        		float varHsmlFac = 1.0 / (1 + hsml[i]/(3*rho[i]) * dRhodHsml[i]);
+
+        		SphP[ipart].Hsml = hsml[i];
+        		SphP[ipart].Rho = rho[i];
+        		SphP[ipart].VarHsmlFac = varHsmlFac;
+
+				Set_cost(COST_HSML, ipart, cost[i]);
+			}
+    	}
+
+		Add_busy_time(COST_HSML, omp_get_wtime() - t0);
+	}
+
+	Finish_ngb_cache();
+
+    return;
+}
+
+/*
+ * Density and VarHsmlFac of the gas at the current hsml, for a final pass 
+ * when hsml has converged. Every pair of particles is evaluated once: The 
+ * separation is found once and the kernel of each side is added to both 
+ * particles. The leaf pairs come from the tree, threads work through the 
+ * leaf chunks of one colour at a time. The sums of a particle are kept in 
+ * registers over all its partners, the scatter to the partners needs no 
+ * locks. Needs the gas tree, the tree keeps the hsml buffer.
+ */
+
+void Find_sph_density()
+{
+	const int npart = Param.Npart[0];
+
+	Density_Hsml = Realloc(Density_Hsml, npart * sizeof(*Density_Hsml));
+
+	float *hsml_inv = Malloc(npart * sizeof(*hsml_inv));
+	float *sum_wk = Malloc(npart * sizeof(*sum_wk));
+	float *sum_dwk = Malloc(npart * sizeof(*sum_dwk));
+	float *pos[3] = { Malloc(npart * sizeof(**pos)), 
+					  Malloc(npart * sizeof(**pos)),
+					  Malloc(npart * sizeof(**pos)) };
+
+	#pragma omp parallel for schedule(static)
+	for (int ipart = 0; ipart < npart; ipart++) {
+
+		Density_Hsml[ipart] = SphP[ipart].Hsml;
+		hsml_inv[ipart] = 1 / SphP[ipart].Hsml;
+		sum_wk[ipart] = sum_dwk[ipart] = 0;
+
+		pos[0][ipart] = P[ipart].Pos[0];
+		pos[1][ipart] = P[ipart].Pos[1];
+		pos[2][ipart] = P[ipart].Pos[2];
+	}
+
+	Set_tree_hsml(Density_Hsml, 1);
+
+	const struct Leaf_Pairs *lp = Find_leaf_pairs();
+
+	#pragma omp parallel
+	for (int col = 0; col < lp->NColours; col++) {
 
-        	int ngblist[NGBMAX] = { 0 };
+		#pragma omp for schedule(dynamic, 1)
+		for (int i = lp->Colour_Offset[col]; i < lp->Colour_Offset[col+1]; i++){
 
-           	int ngbcnt = Find_ngb_tree(ipart, hsml, ngblist); 
+			const int chunk = lp->Colour_Chunk[i];
+
+			for (int a = lp->Chunk[chunk]; a < lp->Chunk[chunk+1]; a++)
+				KERNEL_SPECIALISE(leaf_pair_sums, lp, a, pos, Density_Hsml, 
+						hsml_inv, sum_wk, sum_dwk);
+		}
+	}
+
+	#pragma omp parallel for schedule(static)
+	for (int ipart = 0; ipart < npart; ipart++)
+		set_sph_density(ipart, Density_Hsml[ipart], sum_wk[ipart], 
+				sum_dwk[ipart]);
+
+	Free(hsml_inv); Free(sum_wk); Free(sum_dwk); 
+	Free(pos[0]); Free(pos[1]); Free(pos[2]);
+
+	return ;
+}
+
+/*
+ * SPH density and hsml of the DM particles, to check the sampling noise of 
+ * the halos. The DM particles are Peano sorted and get their own tree, so 
+ * the Halo DM pointers and the gas tree are invalid afterwards.
+ */
+
+extern void Find_DM_density()
+{
+	printf("Finding DM density & hsml "); fflush(stdout);
 
-			if (ngbcnt == NGBMAX) { // prevent overflow of ngblist
+	const int first = Param.Npart[0];
+	const int npart = Param.Npart[1];
+
+	DMP = Realloc(DMP, npart * sizeof(*DMP));
+
+	memset(DMP, 0, npart * sizeof(*DMP));
+
+	Sort_Type_By_Peano_Key(1);
+
+	Build_Tree_Type(1);
+
+	const struct Work_Chunks *wc = Balance_work(COST_DM_HSML, npart);
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int chunk = 0; chunk < wc->NChunks; chunk++) {
+
+		double t0 = omp_get_wtime();
+
+		for (int i = wc->First[chunk]; i < wc->First[chunk+1]; i++) {
+
+			float hsml = 0, rho = 0, dRhodHsml = 0;
+
+			int cost = solve_hsml(first + i, Param.Mpart[1], &Find_ngb_group, 
+					&hsml, &rho, &dRhodHsml);
+
+			DMP[i].Hsml = hsml;
+			DMP[i].Rho = rho;
+
+			Set_cost(COST_DM_HSML, i, cost);
+		}
+
+		Add_busy_time(COST_DM_HSML, omp_get_wtime() - t0);
+	}
+
+    printf("done \n"); fflush(stdout);
+
+	Print_load_balance();
+
+	printf("\n");
+
+	return ;
+}
+
+/*
+ * Find hsml and density of ipart, starting from *hsml_out, or from the 
+ * nearest neighbours if that is 0. Works on the particles in the tree, 
+ * find_ngb searches the same particles. A cached neighbour list saves the 
+ * walk, if the solution stays inside it. If the neighbours do not fit into
+ * a list, hsml is found with count-only queries. Returns the number of 
+ * neighbour candidates processed, the cost of the particle.
+ */
+
+static int solve_hsml(const int ipart, const double mpart,
+		int (*find_ngb)(const int, const float, int*), float *hsml_out,
+		float *rho_out, float *dRhodHsml_out)
+{
+	float hsml = *hsml_out;
+
+	float dRhodHsml = 0;
+	float rho = 0;
+
+	bool part_done = false;
+
+	TREE_STAT(Hsml_Parts, 1);
+
+	int ngblist[NGBMAX]; // filled up to ngbcnt, no need to clear it
+	float r2[NGBMAX]; // squared distances to the closest images
+
+	int ngbcnt = 0;
+	float rad = 0; // all particles closer than rad are in ngblist
+
+	int cost = 1;
+
+	if (hsml > 0) { // same positions as the last solve ?
+
+		ngbcnt = Find_ngb_cache(ipart, ngblist, r2, &rad);
+
+		cost += max(0, ngbcnt);
+
+		if (ngbcnt >= DESNNGB) {
+
+			part_done = hsml_from_r2(ipart, r2, ngbcnt, mpart, &dRhodHsml, &hsml, 
+					&rho);
+
+			if (hsml > rad) // solution outside of the cached list
+				part_done = false;
+		}
+	}
+
+	if (hsml == 0) { // start from the nearest neighbours
 	
-				hsml /= 1.24;
+		float ngbdist[NGBMAX];
 
-				continue;
+		ngbcnt = Find_knn_tree(ipart, KNN_NGB, ngblist, ngbdist);
+
+		cost += ngbcnt;
+
+		TREE_STAT(Hsml_Walks, 1);
+
+		rad = ngbdist[ngbcnt-1];
+
+		Select_nearest(ngblist, ngbdist, ngbcnt, min(DESNNGB, ngbcnt));
+
+		hsml = ngbdist[min(DESNNGB, ngbcnt) - 1];
+
+		ngb_separations(ipart, ngblist, ngbcnt, r2);
+
+		part_done = hsml_from_r2(ipart, r2, ngbcnt, mpart, &dRhodHsml, &hsml, &rho); 
+		
+		if (hsml > rad) // candidates incomplete
+			part_done = false;
+
+		if (part_done)
+			Add_ngb_cache(ipart, hsml, rad, ngblist, r2, ngbcnt);
+	}
+
+	Assert(isfinite(hsml), "hsml not finite ipart=%d parent=%d \n", 
+			ipart, P[ipart].Tree_Parent);
+
+	bool ngbmax_hit = false; // more than NGBMAX neighbours, or we cycle
+
+	while (! part_done) {
+
+		rad = hsml * HSML_SEARCH_FAC;
+
+		ngbcnt = (*find_ngb)(ipart, rad, ngblist); 
+
+		cost += ngbcnt;
+
+		TREE_STAT(Hsml_Walks, 1);
+
+		if (ngbcnt == NGBMAX) { // prevent overflow of ngblist
+
+			TREE_STAT(Retry_Ngbmax, 1);
+
+			hsml /= 1.24;
+
+			ngbmax_hit = true;
+
+			continue;
+		}
+
+		if (ngbcnt < DESNNGB) {
+		
+			TREE_STAT(Retry_Desnngb, 1);
+
+			hsml *= 1.23;
+
+			continue;
+		}
+
+		ngb_separations(ipart, ngblist, ngbcnt, r2);
+
+		part_done = hsml_from_r2(ipart, r2, ngbcnt, mpart, &dRhodHsml, &hsml, &rho); 
+
+		if (hsml > rad && !ngbmax_hit) // neighbours incomplete, walk again
+			part_done = false;
+
+		if (hsml > rad && ngbmax_hit) // list can't hold all, count only
+			part_done = hsml_from_r2(ipart, NULL, 0, mpart, &dRhodHsml, &hsml,
+					&rho);
+
+		if (part_done)
+			Add_ngb_cache(ipart, hsml, rad, ngblist, r2, ngbcnt);
+	}
+
+	*hsml_out = hsml;
+	*rho_out = rho;
+	*dRhodHsml_out = dRhodHsml;
+
+	return cost;
+}
+
+/*
+ * solve_hsml() for the n Peano adjacent particles from first on, SIMD across
+ * particles: KERNEL_BATCH lanes iterate together, each on its own particle.
+ * A lane gets its list from the cache or walks for it, the group walk shares
+ * the candidates of the common leaf. The lists are stored transposed, so one
+ * row of r2 holds a neighbour of every lane and kernel_sums_batch() takes
+ * one vector per row. A converged lane takes the next particle, so the
+ * lanes stay busy. Particles off the common path, without start hsml, with
+ * a full list, or with a solution outside of their list, go on alone with
+ * solve_hsml().
+ */
+
+static void solve_hsml_batch(const int first, const int n,
+		const double mpart, int (*find_ngb)(const int, const float, int*),
+		float *hsml_out, float *rho_out, float *dRhodHsml_out, int *cost)
+{
+	int ngblist[KERNEL_BATCH][NGBMAX];
+	float r2[NGBMAX][KERNEL_BATCH]; // transposed
+	float r2_i[NGBMAX];
+
+	int part[KERNEL_BATCH]; // particle of the lane, from first
+	int ngbcnt[KERNEL_BATCH] = { 0 };
+	int nfilled[KERNEL_BATCH] = { 0 }; // rows of the lane set in r2
+	float rad[KERNEL_BATCH] = { 0 };
+	bool cached[KERNEL_BATCH] = { false };
+
+	struct Hsml_Iteration s[KERNEL_BATCH];
+	int status[KERNEL_BATCH]; // 0 iterating, else idle
+
+	for (int lane = 0; lane < KERNEL_BATCH; lane++) {
+
+		status[lane] = -1;
+		s[lane].Hsml = 1;
+	}
+
+	int next = 0;
+
+	for (;;) {
+
+		for (int lane = 0; lane < KERNEL_BATCH; lane++) { // refill
+
+			while (status[lane] != 0 && next < n) {
+
+				const int i = next++;
+				const int ipart = first + i;
+
+				cost[i] = 1;
+
+				if (hsml_out[i] == 0) {
+
+					cost[i] += solve_hsml(ipart, mpart, find_ngb, &hsml_out[i],
+							&rho_out[i], &dRhodHsml_out[i]);
+					continue;
+				}
+
+				int cnt = Find_ngb_cache(ipart, ngblist[lane], r2_i, &rad[lane]);
+
+				cost[i] += max(0, cnt);
+
+				cached[lane] = cnt >= DESNNGB;
+
+				if (! cached[lane]) {
+
+					for (;;) {
+
+						rad[lane] = hsml_out[i] * HSML_SEARCH_FAC;
+
+						cnt = (*find_ngb)(ipart, rad[lane], ngblist[lane]);
+
+						cost[i] += cnt;
+
+						TREE_STAT(Hsml_Walks, 1);
+
+						if (cnt >= DESNNGB)
+							break;
+
+						TREE_STAT(Retry_Desnngb, 1);
+
+						hsml_out[i] *= 1.23;
+					}
+
+					if (cnt == NGBMAX) { // the scalar solve handles it
+
+						cost[i] += solve_hsml(ipart, mpart, find_ngb,
+								&hsml_out[i], &rho_out[i], &dRhodHsml_out[i]);
+						continue;
+					}
+
+					ngb_separations(ipart, ngblist[lane], cnt, r2_i);
+				}
+
+				for (int k = 0; k < cnt; k++)
+					r2[k][lane] = r2_i[k];
+
+				for (int k = cnt; k < nfilled[lane]; k++)
+					r2[k][lane] = FLT_MAX; // beyond any hsml
+
+				nfilled[lane] = max(cnt, nfilled[lane]);
+				ngbcnt[lane] = cnt;
+				part[lane] = i;
+
+				s[lane] = hsml_start(hsml_out[i]);
+				status[lane] = 0;
 			}
+		}
+
+		int nrow = 0;
+
+		for (int lane = 0; lane < KERNEL_BATCH; lane++)
+			if (status[lane] == 0)
+				nrow = max(nrow, ngbcnt[lane]);
+
+		if (nrow == 0) // all done
+			break;
 
-			if (ngbcnt < DESNNGB) {
-			
-				hsml *= 1.23;
+		float hsml[KERNEL_BATCH];
 
+		for (int lane = 0; lane < KERNEL_BATCH; lane++) {
+
+			for (; nfilled[lane] < nrow; nfilled[lane]++)
+				r2[nfilled[lane]][lane] = FLT_MAX;
+
+			hsml[lane] = s[lane].Hsml;
+		}
+
+		double sum_wk[KERNEL_BATCH], sum_dwk[KERNEL_BATCH];
+
+		KERNEL_SPECIALISE(kernel_sums_batch, (const float (*)[KERNEL_BATCH]) r2,
+				nrow, hsml, sum_wk, sum_dwk);
+
+		for (int lane = 0; lane < KERNEL_BATCH; lane++) {
+
+			if (status[lane] != 0)
 				continue;
-			}
 
-           	bool part_done = Find_hsml(ipart, ngblist, ngbcnt, &dRhodHsml, 
-                    &hsml, &rho); 
+			status[lane] = hsml_step(&s[lane], mpart, sum_wk[lane],
+					sum_dwk[lane]);
+
+			if (status[lane] == 0)
+				continue;
 
-			if (ngbcnt < DESNNGB && (!part_done))
-				hsml *= 1.24;
+			const int i = part[lane];
+			const int ipart = first + i;
 
-           	if (part_done)
-                break;
-        }
+			if (status[lane] == 1 && s[lane].Hsml <= rad[lane]) {
 
-        float varHsmlFac = 1.0 / ( 1 + hsml/(3*rho)* dRhodHsml );
+				TREE_STAT(Hsml_Parts, 1);
 
-        SphP[ipart].Hsml = hsml;
-        SphP[ipart].Rho = rho;
-        SphP[ipart].VarHsmlFac = varHsmlFac;
+				hsml_finish(&s[lane], status[lane], mpart, &dRhodHsml_out[i],
+						&hsml_out[i], &rho_out[i]);
 
-    }
+				if (cached[lane])
+					continue;
 
-    return;
+				for (int k = 0; k < ngbcnt[lane]; k++)
+					r2_i[k] = r2[k][lane];
+
+				Add_ngb_cache(ipart, hsml_out[i], rad[lane], ngblist[lane],
+						r2_i, ngbcnt[lane]);
+
+			} else { // walk again from the new hsml
+
+				hsml_out[i] = s[lane].Hsml;
+
+				cost[i] += solve_hsml(ipart, mpart, find_ngb, &hsml_out[i],
+						&rho_out[i], &dRhodHsml_out[i]);
+			}
+		}
+	}
+
+	return ;
 }
 
 /* 
- * solve SPH continuity eq via Newton-Raphson, bisection and tree search 
+ * solve SPH continuity eq via Newton-Raphson, bisection and tree search. 
+ * The neighbour separations do not change, so we find them once and every 
+ * iteration only sums the kernel in units of hsml, see kernel_sums().
  */
 extern bool Find_hsml(const int ipart, const int *ngblist, const int ngbcnt,
-        float *dRhodHsml_out, float *hsml_out, float *rho_out)
+        const double mpart, float *dRhodHsml_out, float *hsml_out, 
+		float *rho_out)
 {
-    const double boxhalf = 0.5 * Param.Boxsize;
-    const double boxsize = Param.Boxsize;
+	float r2[NGBMAX]; // squared distances to the closest images
 
-    double upper = *hsml_out*sqrt3;
-    double lower = 0;
-    
-    double hsml = *hsml_out; //lower + 0.5*(upper-lower); 
-    double rho = 0, dRhodHsml = 0;
+	ngb_separations(ipart, ngblist, ngbcnt, r2);
 
-    int it = 0;
+	return hsml_from_r2(ipart, r2, ngbcnt, mpart, dRhodHsml_out, hsml_out, rho_out);
+}
 
-    bool part_done = 0;
+static void ngb_separations(const int ipart, const int *ngblist, 
+		const int ngbcnt, float *r2)
+{
+    const float boxsize = Param.Boxsize;
 
-    for (;;) {  
-    
-		const double pos_i[3] = { P[ipart].Pos[0], P[ipart].Pos[1],
-			P[ipart].Pos[2] };
+	const float pos_i[3] = { P[ipart].Pos[0], P[ipart].Pos[1], P[ipart].Pos[2] };
 
-        double wkNgb = 0; // kernel weight number of neighbours
+	for (int i = 0; i < ngbcnt; i++) {
 
-        rho = dRhodHsml = 0;
-        
-        it++;
+		const int jpart = ngblist[i];
 
-        for (int i = 0; i < ngbcnt; i++) {
+		float dx = fabsf(pos_i[0] - P[jpart].Pos[0]);
+		float dy = fabsf(pos_i[1] - P[jpart].Pos[1]);
+		float dz = fabsf(pos_i[2] - P[jpart].Pos[2]);
 
-	    	int jpart = ngblist[i];	
+		dx = min(dx, boxsize - dx);
+		dy = min(dy, boxsize - dy);
+		dz = min(dz, boxsize - dz);
 
-            double dx = pos_i[0] - P[jpart].Pos[0];
-	    	double dy = pos_i[1] - P[jpart].Pos[1];
-    		double dz = pos_i[2] - P[jpart].Pos[2];
-			
-		    if (dx > boxhalf)	// find closest image 
-	    		dx -= boxsize;
+		r2[i] = dx*dx + dy*dy + dz*dz;
+	}
 
-    		if (dx < -boxhalf)
-		    	dx += boxsize;
+	return ;
+}
 
-	    	if (dy > boxhalf)
-    			dy -= boxsize;
+/*
+ * Solve for hsml of ipart from the squared separations of its neighbours.
+ * Without r2 the kernel sums come from count-only tree queries, so no list
+ * is needed, see Find_ngb_weight().
+ */
 
-		    if (dy < -boxhalf)
-	    		dy += boxsize;
+static bool hsml_from_r2(const int ipart, const float *r2, const int ngbcnt,
+		const double mpart, float *dRhodHsml_out, float *hsml_out,
+		float *rho_out)
+{
+	struct Hsml_Iteration s = hsml_start(*hsml_out);
 
-    		if (dz > boxhalf)
-			    dz -= boxsize;
+	int status = 0;
 
-		    if (dz < -boxhalf)
-	    		dz += boxsize;
+	while (status == 0) {
 
-            double r2 = dx*dx + dy*dy + dz*dz;
+		double sum_wk = 0, sum_dwk = 0;
 
-    		if (r2 > p2(hsml)) 
-                continue ;
-                    
-    		double r = sqrt(r2);
+		if (r2 != NULL) {
+			KERNEL_SPECIALISE(kernel_sums, r2, ngbcnt, s.Hsml, &sum_wk,
+					&sum_dwk);
+		} else {
+			Find_ngb_weight(ipart, s.Hsml, &sum_wk, &sum_dwk); // count only
+		}
 
-#ifdef SPH_CUBIC_SPLINE
-			double wk = sph_kernel_M4(r, hsml);
-			double dwk = sph_kernel_derivative_M4(r, hsml);
-#else
-		    double wk = sph_kernel_WC6(r, hsml);
-		    double dwk = sph_kernel_derivative_WC6(r, hsml);
-#endif // SPH_CUBIC_SPLINE
+		status = hsml_step(&s, mpart, sum_wk, sum_dwk);
+	}
 
+	return hsml_finish(&s, status, mpart, dRhodHsml_out, hsml_out, rho_out);
+}
 
-            wkNgb += fourpithird*wk*p3(hsml);
+static struct Hsml_Iteration hsml_start(const double hsml)
+{
+	TREE_STAT(Hsml_Solves, 1);
 
-            rho += Param.Mpart[0]*wk;
+	return (struct Hsml_Iteration) { .Hsml = hsml, .Upper = hsml * sqrt3 };
+}
 
-            dRhodHsml += -Param.Mpart[0] * ( 3/hsml*wk + r/hsml * dwk );
-        }
+/*
+ * One Newton-Raphson or bisection step from the kernel sums at s->Hsml.
+ * Returns 1 if the kernel weighted neighbour number is converged, -1 if the
+ * solve has to stop, with a larger hsml if there are too few neighbours,
+ * and 0 to go on with the sums at the new s->Hsml.
+ */
 
-       if (it > 128) // not enough neighbours ? -> hard exit 
-            break;
-        
-       double ngbDev = fabs(wkNgb - DESNNGB);
-        
-	   if (ngbDev < NNGBDEV) {
+static int hsml_step(struct Hsml_Iteration *s, const double mpart,
+		const double sum_wk, const double sum_dwk)
+{
+	const double norm = Kernel.Norm;
+	const double hsml = s->Hsml;
 
-            part_done = true;
+	s->It++;
 
-            break;
-		}
+	double wkNgb = fourpithird * norm * sum_wk; // kernel weighted ngbs
 
-        if (fabs(upper-lower) < 1e-4) { // find more neighbours ! 
-            
-            hsml *= 1.26; // double volume
-            
-            break;
-        }
+	s->Rho = mpart * norm * sum_wk / p3(hsml);
 
-		if (ngbDev < 0.5 * DESNNGB) { // Newton Raphson
+	s->DRhodHsml = -mpart * norm * (3*sum_wk + sum_dwk) / p2(p2(hsml));
 
-			double omega =  (1 + dRhodHsml * hsml / (3*rho));
+	if (s->It > 128) // not enough neighbours ? -> hard exit
+		return -1;
 
-	     	double fac = 1 - (wkNgb - DESNNGB) / (3*wkNgb * omega);
+	double ngbDev = fabs(wkNgb - DESNNGB);
 
-			fac = fmin(1.24, fac); // handle overshoot
-			fac = fmax(1/1.24, fac);
+	if (ngbDev < NNGBDEV)
+		return 1;
 
-			hsml *= fac;    
- 
-		} else {  // bisection
+	if (fabs(s->Upper - s->Lower) < 1e-4) { // find more neighbours !
 
-			if (wkNgb > DESNNGB) 
-    	        upper = hsml;
+		s->Hsml *= 1.26; // double volume
 
-	        if (wkNgb < DESNNGB) 
-            	lower = hsml;
-        
-        	hsml = pow( 0.5 * ( p3(lower) + p3(upper) ), 1.0/3.0 );
-		}
-    } // for(;;)
-    
-    *hsml_out = (float) hsml;
-    *rho_out = (float) rho;
-
-#ifndef SPH_CUBIC_SPLINE
-    if (part_done) {
-    
-        *dRhodHsml_out = (float) dRhodHsml;
-
-        double bias_corr = -0.0116 * pow(DESNNGB*0.01, -2.236) 
-            * Param.Mpart[0] * sph_kernel_WC6(0, hsml); // WC6 (Dehnen+ 12)
-    
-        *rho_out += bias_corr;   
-    }
-#endif
+		return -1;
+	}
+
+	if (ngbDev < 0.5 * DESNNGB) { // Newton Raphson
+
+		TREE_STAT(Newton_Its, 1);
 
-    return part_done;
+		double omega =  (1 + s->DRhodHsml * hsml / (3*s->Rho));
+
+		double fac = 1 - (wkNgb - DESNNGB) / (3*wkNgb * omega);
+
+		fac = fmin(1.24, fac); // handle overshoot
+		fac = fmax(1/1.24, fac);
+
+		s->Hsml *= fac;
+
+	} else {  // bisection
+
+		TREE_STAT(Bisection_Its, 1);
+
+		if (wkNgb > DESNNGB)
+			s->Upper = hsml;
+
+		if (wkNgb < DESNNGB)
+			s->Lower = hsml;
+
+		s->Hsml = pow( 0.5 * ( p3(s->Lower) + p3(s->Upper) ), 1.0/3.0 );
+	}
+
+	return 0;
 }
 
+/*
+ * Results of a solve, a converged density gets the bias correction.
+ */
+
+static bool hsml_finish(const struct Hsml_Iteration *s, const int status,
+		const double mpart, float *dRhodHsml_out, float *hsml_out,
+		float *rho_out)
+{
+	*hsml_out = (float) s->Hsml;
+	*rho_out = (float) s->Rho;
+
+	if (status == 1) {
+
+		*dRhodHsml_out = (float) s->DRhodHsml;
+
+		double bias_corr = -Kernel.Bias_Eps * pow(DESNNGB*0.01,
+				-Kernel.Bias_Alpha) * mpart * Kernel.Norm / p3(s->Hsml);
+
+		*rho_out += bias_corr; // W(0,h)
+	}
+
+	return status == 1;
+}
+
+/*
+ * Density, VarHsmlFac and B = rot(A) of the gas at the current hsml, fused
+ * into one loop over the neighbours of a particle. The lists come from the
+ * neighbour cache of the last hsml solve if possible.
+ */
+
 extern void Bfld_from_rotA_SPH()
 {
 	printf("Constructing B from rot(A)");fflush(stdout);
 
 	const double mpart = Param.Mpart[0];
-	const double boxhalf = Param.Boxsize / 2;
-    const double boxsize = Param.Boxsize;
 
-	#pragma omp parallel for schedule(dynamic, Param.Npart[0]/Omp.NThreads/64)
-    for (int ipart = 0; ipart < Param.Npart[0]; ipart++) {
+	const struct Work_Chunks *wc = Balance_work(COST_BFLD, Param.Npart[0]);
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int chunk = 0; chunk < wc->NChunks; chunk++) {
+
+		double t0 = omp_get_wtime();
+
+    	for (int ipart = wc->First[chunk]; ipart < wc->First[chunk+1]; ipart++) {
         
-		int ngblist[NGBMAX] = { 0 };
-	    int ngbcnt = Find_ngb_tree(ipart, SphP[ipart].Hsml, ngblist);
+			const double hsml = SphP[ipart].Hsml;
 
-        double varHsmlFac = SphP[ipart].VarHsmlFac;
-        double hsml = SphP[ipart].Hsml;
-        double rho_i = SphP[ipart].Rho;
+			int ngblist[NGBMAX];
 
-        double pos_i[3] = {P[ipart].Pos[0], P[ipart].Pos[1], P[ipart].Pos[2]};
+			int ngbcnt = sph_ngb(ipart, hsml, ngblist);
 
-		double apot_i[3] = {SphP[ipart].Apot[0], SphP[ipart].Apot[1], 
-							SphP[ipart].Apot[2]};
+			double sum_wk = 0, sum_dwk = 0, rot[3] = { 0 };
 
-		double bfld[3] = { 0 };
+			KERNEL_SPECIALISE(density_rotA, ipart, ngblist, ngbcnt, &sum_wk, 
+					&sum_dwk, rot);
 
-         for (int i = 0; i < ngbcnt; i++) {
+			if (ngbcnt < NGBMAX) // else truncated, keep density of the solve
+				set_sph_density(ipart, hsml, sum_wk, sum_dwk);
 
-			int jpart = ngblist[i];	
+			const double fac = -mpart / SphP[ipart].Rho * Kernel.Norm 
+				/ p2(p2(hsml)) * SphP[ipart].VarHsmlFac; // dW/dr = norm dw/du
 
-            if (jpart == ipart)
-                continue;
+        	SphP[ipart].Bfld[0] = (float) (fac * rot[0]);
+			SphP[ipart].Bfld[1] = (float) (fac * rot[1]);
+			SphP[ipart].Bfld[2] = (float) (fac * rot[2]);
 
-			double dx = pos_i[0] - P[jpart].Pos[0];
-			double dy = pos_i[1] - P[jpart].Pos[1];
-			double dz = pos_i[2] - P[jpart].Pos[2];
-			
-			if (dx > boxhalf)	// find closest image 
-				dx -= boxsize;
+			Set_cost(COST_BFLD, ipart, 1 + ngbcnt);
+		}
 
-			if (dx < -boxhalf)
-				dx += boxsize;
+		Add_busy_time(COST_BFLD, omp_get_wtime() - t0);
+	}
 
-			if (dy > boxhalf)
-				dy -= boxsize;
+    printf(" done \n\n");fflush(stdout);
 
-			if (dy < -boxhalf)
-				dy += boxsize;
+	return ;
+}
 
-			if (dz > boxhalf)
-				dz -= boxsize;
+#ifdef OUTPUT_DIVB
+/*
+ * SPH estimate of div B of the gas, in the difference form like rot(A), 
+ * with the final B of the neighbours. Prints the divergence error 
+ * h |div B| / |B|.
+ */
 
-			if (dz < -boxhalf)
-				dz += boxsize;
+void Find_sph_divB()
+{
+	double err_mean = 0, err_max = 0;
 
-            double r2 = p2(dx) + p2(dy) + p2(dz);
+	const struct Work_Chunks *wc = Balance_work(COST_DIVB, Param.Npart[0]);
 
-			if (r2 > hsml*hsml) 
-                continue ;
-                
-			double r = sqrt(r2);
+	#pragma omp parallel for reduction(+:err_mean) reduction(max:err_max) \
+		schedule(dynamic, 1)
+	for (int chunk = 0; chunk < wc->NChunks; chunk++) {
 
-			double dwk = sph_kernel_derivative_WC6(r, hsml);
+		double t0 = omp_get_wtime();
 
-			double weight = -mpart/rho_i * dwk / r  * varHsmlFac;
+    	for (int ipart = wc->First[chunk]; ipart < wc->First[chunk+1]; ipart++) {
 
-            /* Price JCOP 2010, eq 79 */
-		    double dAx = apot_i[0] - SphP[jpart].Apot[0];
-			double dAy = apot_i[1] - SphP[jpart].Apot[1];
-			double dAz = apot_i[2] - SphP[jpart].Apot[2];
+			const float hsml = SphP[ipart].Hsml;
 
-			bfld[0] += weight * (dz*dAy - dy*dAz); // B = rot(A)
-			bfld[1] += weight * (dx*dAz - dz*dAx);
-			bfld[2] += weight * (dy*dAx - dx*dAy);
+			int ngblist[NGBMAX];
+
+			int ngbcnt = sph_ngb(ipart, hsml, ngblist);
+
+			double div = 0;
+
+			KERNEL_SPECIALISE(divB, ipart, ngblist, ngbcnt, &div);
+
+			SphP[ipart].DivB = div;
+
+			double B = sqrt(p2(SphP[ipart].Bfld[0]) + p2(SphP[ipart].Bfld[1]) 
+					+ p2(SphP[ipart].Bfld[2]));
+
+			double err = (B > 0) ? hsml * fabs(div) / B : 0;
+
+			err_mean += err;
+			err_max = fmax(err_max, err);
+
+			Set_cost(COST_DIVB, ipart, 1 + ngbcnt);
 		}
 
-        SphP[ipart].Bfld[0] = (float) bfld[0];
-		SphP[ipart].Bfld[1] = (float) bfld[1];
-		SphP[ipart].Bfld[2] = (float) bfld[2];
+		Add_busy_time(COST_DIVB, omp_get_wtime() - t0);
 	}
 
-    printf(" done \n\n");fflush(stdout);
+	printf("div B error h|div B|/|B|: mean %g, max %g \n\n", 
+			err_mean/Param.Npart[0], err_max);
+
+	return ;
+}
+#endif // OUTPUT_DIVB
+
+/*
+ * Density with bias correction and VarHsmlFac of ipart from its kernel
+ * sums at hsml, see kernel_sums().
+ */
+
+static void set_sph_density(const int ipart, const double hsml, 
+		const double sum_wk, const double sum_dwk)
+{
+	const double mpart = Param.Mpart[0];
+	const double norm = Kernel.Norm;
+
+	double rho = mpart * norm * sum_wk / p3(hsml);
+
+	double dRhodHsml = -mpart * norm * (3*sum_wk + sum_dwk) / p2(p2(hsml));
+
+	rho += -Kernel.Bias_Eps * pow(DESNNGB*0.01, -Kernel.Bias_Alpha) 
+		* mpart * norm / p3(hsml); // W(0,h)
+
+	SphP[ipart].Rho = rho;
+	SphP[ipart].VarHsmlFac = 1.0 / (1 + hsml/(3*rho) * dRhodHsml);
 
 	return ;
 }
 
-static inline float sph_kernel_WC6(const float r, const float h)
-{   
-	const double u= r/h;
-    const double t = 1-u;
+/*
+ * Neighbours of a gas particle inside hsml from the neighbour cache, or 
+ * from the tree. Cached lists may contain particles outside of hsml.
+ */
+
+static int sph_ngb(const int ipart, const float hsml, int *ngblist)
+{
+	float rad = 0;
+
+	int ngbcnt = Find_ngb_cache(ipart, ngblist, NULL, &rad);
+
+	if (ngbcnt < 0 || rad < hsml)
+		ngbcnt = Find_ngb_group(ipart, hsml, ngblist);
 
-    return 1365.0/(64*pi)/p3(h) *t*t*t*t*t*t*t*t*(1+8*u + 25*u*u + 32*u*u*u);
+	return ngbcnt;
 }
 
-static inline float sph_kernel_derivative_WC6(const float r, const float h)
-{   
-	const float u = r/h;
-    const double t = 1-u;
+/*
+ * Kernel sums and the SPH estimate of rot(A) at ipart in one loop (Price JCOP
+ * 2010, eq 79). The density and VarHsmlFac are constant factors of the curl,
+ * they are applied by the caller.
+ */
+
+KERNEL_INLINE void density_rotA(const int type, const int ipart, 
+		const int *ngblist, const int ngbcnt, double *sum_wk, double *sum_dwk,
+		double rot[3])
+{
+	const double boxhalf = Param.Boxsize / 2;
+    const double boxsize = Param.Boxsize;
+
+    double hsml = SphP[ipart].Hsml;
+
+    double pos_i[3] = {P[ipart].Pos[0], P[ipart].Pos[1], P[ipart].Pos[2]};
+
+	double apot_i[3] = {SphP[ipart].Apot[0], SphP[ipart].Apot[1], 
+						SphP[ipart].Apot[2]};
+
+	for (int i = 0; i < ngbcnt; i++) {
 
-    return 1365.0/(64*pi)/(h*h*h*h) * -22.0 *t*t*t*t*t*t*t*u*(16*u*u+7*u+1);
+		int jpart = ngblist[i];	
+
+		double dx = pos_i[0] - P[jpart].Pos[0];
+		double dy = pos_i[1] - P[jpart].Pos[1];
+		double dz = pos_i[2] - P[jpart].Pos[2];
+		
+		if (dx > boxhalf)	// find closest image 
+			dx -= boxsize;
+
+		if (dx < -boxhalf)
+			dx += boxsize;
+
+		if (dy > boxhalf)
+			dy -= boxsize;
+
+		if (dy < -boxhalf)
+			dy += boxsize;
+
+		if (dz > boxhalf)
+			dz -= boxsize;
+
+		if (dz < -boxhalf)
+			dz += boxsize;
+
+        double r2 = p2(dx) + p2(dy) + p2(dz);
+
+		if (r2 > hsml*hsml) 
+            continue ;
+            
+		double r = sqrt(r2);
+		double u = r / hsml;
+
+		float wk, dwk; // u dw/du
+
+		kernel_poly(type, u, &wk, &dwk);
+
+		*sum_wk += wk;
+		*sum_dwk += dwk;
+
+        if (r2 == 0) // self, no gradient
+            continue;
+
+		double weight = dwk / u / r;
+
+	    double dAx = apot_i[0] - SphP[jpart].Apot[0];
+		double dAy = apot_i[1] - SphP[jpart].Apot[1];
+		double dAz = apot_i[2] - SphP[jpart].Apot[2];
+
+		rot[0] += weight * (dz*dAy - dy*dAz); // B = rot(A)
+		rot[1] += weight * (dx*dAz - dz*dAx);
+		rot[2] += weight * (dy*dAx - dx*dAy);
+	}
+
+	return ;
 }
 
-static inline float sph_kernel_M4(const float r, const float h) // cubic spline
+#ifdef OUTPUT_DIVB
+KERNEL_INLINE void divB(const int type, const int ipart, const int *ngblist,
+		const int ngbcnt, double *div)
 {
-	double wk = 0;
-   	double u = r/h;
- 
-	if(u < 0.5) 
-		wk = (2.546479089470 + 15.278874536822 * (u - 1) * u * u);
-	else
-		wk = 5.092958178941 * (1.0 - u) * (1.0 - u) * (1.0 - u);
-	
-	return wk/p3(h);
+	const double mpart = Param.Mpart[0];
+	const double boxhalf = Param.Boxsize / 2;
+    const double boxsize = Param.Boxsize;
+
+    double hsml = SphP[ipart].Hsml;
+
+    double pos_i[3] = {P[ipart].Pos[0], P[ipart].Pos[1], P[ipart].Pos[2]};
+
+	double bfld_i[3] = {SphP[ipart].Bfld[0], SphP[ipart].Bfld[1], 
+						SphP[ipart].Bfld[2]};
+
+	for (int i = 0; i < ngbcnt; i++) {
+
+		int jpart = ngblist[i];	
+
+		double dx = pos_i[0] - P[jpart].Pos[0];
+		double dy = pos_i[1] - P[jpart].Pos[1];
+		double dz = pos_i[2] - P[jpart].Pos[2];
+		
+		if (dx > boxhalf)	// find closest image 
+			dx -= boxsize;
+
+		if (dx < -boxhalf)
+			dx += boxsize;
+
+		if (dy > boxhalf)
+			dy -= boxsize;
+
+		if (dy < -boxhalf)
+			dy += boxsize;
+
+		if (dz > boxhalf)
+			dz -= boxsize;
+
+		if (dz < -boxhalf)
+			dz += boxsize;
+
+        double r2 = p2(dx) + p2(dy) + p2(dz);
+
+		if (r2 > hsml*hsml || r2 == 0) // self, no gradient
+            continue ;
+            
+		double r = sqrt(r2);
+		double u = r / hsml;
+
+		float wk, dwk; // u dw/du
+
+		kernel_poly(type, u, &wk, &dwk);
+
+	    double dBx = bfld_i[0] - SphP[jpart].Bfld[0];
+		double dBy = bfld_i[1] - SphP[jpart].Bfld[1];
+		double dBz = bfld_i[2] - SphP[jpart].Bfld[2];
+
+		*div += dwk / u / r * (dx*dBx + dy*dBy + dz*dBz);
+	}
+
+	*div *= -mpart / SphP[ipart].Rho * Kernel.Norm / p2(p2(hsml)) 
+		* SphP[ipart].VarHsmlFac;
+
+	return ;
 }
+#endif // OUTPUT_DIVB
+
+/*
+ * Kernel sums of the particles of leaf a and its partner leaves, see 
+ * kernel_sums(). Pairs inside a are taken once, the particle itself adds 
+ * w(0) = 1. A lane adds to a side only if r is inside that hsml.
+ */
 
-static inline float sph_kernel_derivative_M4(const float r, const float h)
+KERNEL_INLINE void leaf_pair_sums(const int type, const struct Leaf_Pairs *lp,
+		const int a, float *pos[3], const float *hsml, const float *hsml_inv, 
+		float *sum_wk, float *sum_dwk)
 {
-	double dwk = 0;
-	double u = r/h;
-  	
-   	if(u < 0.5) 
-		dwk = u * (45.836623610466 * u - 30.557749073644);
-	else
-		dwk = (-15.278874536822) * (1.0 - u) * (1.0 - u);
-   
-   return dwk/(h*h*h*h);
+	const float boxsize = Param.Boxsize;
+	const int last_a = lp->First[a] + lp->Npart[a];
+
+	for (int ipart = lp->First[a]; ipart < last_a; ipart++) {
+
+		const float pos_i[3] = { pos[0][ipart], pos[1][ipart], pos[2][ipart] };
+		const float h2_i = p2(hsml[ipart]);
+		const float h_inv_i = hsml_inv[ipart];
+
+		float wk_i = 1, dwk_i = 0; // self
+
+		for (int k = lp->Offset[a]; k < lp->Offset[a+1]; k++) {
+
+			const int b = lp->Partner[k];
+			const int first = (b == a) ? ipart + 1 : lp->First[b];
+			const int last = lp->First[b] + lp->Npart[b];
+
+			#pragma omp simd reduction(+:wk_i,dwk_i)
+			for (int jpart = first; jpart < last; jpart++) {
+
+				float dx = fabsf(pos_i[0] - pos[0][jpart]);
+				float dy = fabsf(pos_i[1] - pos[1][jpart]);
+				float dz = fabsf(pos_i[2] - pos[2][jpart]);
+
+				dx = min(dx, boxsize - dx);
+				dy = min(dy, boxsize - dy);
+				dz = min(dz, boxsize - dz);
+
+				const float r2 = dx*dx + dy*dy + dz*dz;
+				const float r = sqrtf(r2);
+
+				float wk, dwk;
+
+				kernel_poly(type, min(1, r * h_inv_i), &wk, &dwk);
+
+				const float inside_i = (r2 < h2_i);
+
+				wk_i += inside_i * wk;
+				dwk_i += inside_i * dwk;
+
+				kernel_poly(type, min(1, r * hsml_inv[jpart]), &wk, &dwk);
+
+				const float inside_j = (r2 < p2(hsml[jpart]));
+
+				sum_wk[jpart] += inside_j * wk;
+				sum_dwk[jpart] += inside_j * dwk;
+			}
+		}
+
+		sum_wk[ipart] += wk_i;
+		sum_dwk[ipart] += dwk_i;
+	}
+
+	return ;
 }
@@ -1,2 +1,3 @@
-extern bool Find_hsml(const int,const int*, const int,float*,float*,float*);
+extern bool Find_hsml(const int,const int*, const int, const double, float*,
+		float*,float*);
 extern void Bfld_from_rotA_SPH();
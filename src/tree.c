@@ -1,6 +1,24 @@
 #include "globals.h"
-
-#define NODES_PER_PARTICLE 2.5
+#include "kernel.h"
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifndef TREE_LEAF_SIZE
+#define TREE_LEAF_SIZE 16 // max number of particles in a leaf
+#endif
+
+#define TREE_NODE_CHUNK (1 << 16) // node pool grows by multiples of this
+#define TOP_SEGMENTS_PER_THREAD 16 // parallel build: subtrees per thread
+#define TREE_STACK_SIZE (8*(N_PEANO_TRIPLETS+1)) // open blocks in a walk
+#define GROUP_HSML_FAC 1.1 // group search radius over the first hsml
+#define GROUP_CHUNK 64 // candidates filtered at once
+#define GRAV_THETA 0.5 // Barnes-Hut opening angle
+#ifndef LEAF_CHUNK
+#define LEAF_CHUNK 64 // leaves coloured together in Find_leaf_pairs()
+#endif
+#define LEAF_COLOUR_WORDS 4 // at most 256 colours
 
 struct Tree_Node {
 	uint32_t Bitfield; 	// bit 0-5:level, 6-8:key, 9:local, 10:top, 11-31:free
@@ -13,290 +31,2453 @@ struct Tree_Node {
 int NNodes = 0;
 int Max_Nodes = 0;
 
-static inline int key_fragment(const int node);
-static inline void add_particle_to_node(const int ipart, const int node);
-static inline bool particle_is_inside_node(const peanoKey key, const int lvl,		const int node);
-static inline void create_node_from_particle(const int ipart,const int parent,
-		const peanoKey key, const int lvl, int *NNodes);
+static int NNodes_High_Water = 0; // most nodes ever used
+
+static int Tree_First = 0, Tree_Npart = 0; // particle range of the tree
+
+#ifdef TREE_STATISTICS
+#pragma omp threadprivate(Tree_Stats)
+struct Tree_Statistics Tree_Stats = { 0 };
+#endif
+
+static float *Leaf_Pos[3] = { NULL }; // SoA positions, index ipart-Tree_First
+static int Max_Leaf_Pos = 0;
+
+#if defined(__AVX2__) && !defined(__AVX512F__)
+static uint32_t Compress_Lut[256] = { 0 }; // set bit positions as nibbles
+#endif
+
+/* For the walk, the children of every internal node are stored together in
+ * a block, so one SIMD test checks all of them. Nodes are represented by the
+ * bounding box of their particles. Block 0 holds the root. A block fills 
+ * four and a half cache lines. */
+
+static struct Tree_Block {
+	float Pos[3][8];	// bounding box centres
+	float Ext[3][8];	// bounding box half sides, -FLT_MAX for empty lanes
+	int Next[8];		// block of an internal node, or particle -Next-1
+	int Npart[8];		// number of particles in node
+	float Hsml[8];		// max hsml of the particles in node, symmetric walk
+} *Block = NULL;
+
+static int NBlocks = 0, Max_Blocks = 0;
+static void *Block_Memory = NULL; // unaligned
+static int *Node_Block = NULL; // block of children of a node
+
+static struct Node_Bounds {
+	float Lo[3];
+	float Hi[3];
+} *Bounds = NULL; // bounding box of the particles in a node
+
+static const float *Ngb_Hsml = NULL; // particle hsml of the symmetric walk
+static float Ngb_Hsml_Scale = 1;
+static float *Node_Hsml = NULL;
+
+static struct Leaf_Pairs Pairs = { 0 }; // leaf interaction lists
+static int Max_Leaves = 0, Max_Partners = 0;
+static int *Leaf_Node = NULL; // tree node of a leaf
+static int *Leaf_Index = NULL; // leaf of its first particle
+static int *Chunk_Colour = NULL;
+static uint64_t (*Colour_Mask)[LEAF_COLOUR_WORDS] = NULL; // colours writing
+
+static struct Node_Moments { // multipoles of the mass in a node, gravity walk
+	float Com[3];		// centre of mass
+	float Mass;
+	float Quad[6];		// traceless quadrupole xx, yy, zz, xy, xz, yz
+} *Moments = NULL;
+
+static struct Tree_Segment { // part of the tree, contiguous in memory
+	int First;				// first particle
+	int Npart;				// number of particles
+	int Parent;				// segment holding the parent node
+	bool Is_Top;			// single node above the domain level
+	struct Tree_Node Root;	// first node of the segment
+	int NNodes;				// number of nodes in the segment
+	int Offset;				// first node in Tree
+	int Local_Offset;		// first node in Local_Tree
+	int ThreadID;			// thread that built the segment
+} *Seg = NULL;
+
+static int NSeg = 0, Max_Seg = 0;
+
+static int Tree_Version = 0; // changes with the tree or the node hsml
+
+static struct Ngb_Group { // a leaf and the candidates around it
+	int First;			// first particle of the leaf
+	int Last;			// behind the last particle of the leaf
+	int Version;		// Tree_Version of the candidates
+	bool Symmetric;		// candidates include scatter neighbours
+	float Hsml;			// largest hsml covered by the candidates
+	int NCand;
+	int Max_Cand;
+	int *Cand;			// candidate particles
+	float *Cand_Pos[3];	// their positions
+	float *Cand_Hsml;	// and hsml in a symmetric walk
+} Group = { 0, 0, -1, false, 0, 0, 0, NULL, { NULL }, NULL };
+#pragma omp threadprivate(Group)
+
+static struct Tree_Node *Local_Tree = NULL; // subtrees built by this thread
+static int Local_NNodes = 0, Local_Max_Nodes = 0;
+#pragma omp threadprivate(Local_Tree, Local_NNodes, Local_Max_Nodes)
+
+static int domain_level();
+static void find_segments(const int first, const int npart, const int lvl, 
+		const int parent, struct Tree_Node node, const int domain_lvl);
+static void add_segment(const int first, const int npart, const int parent,
+		const struct Tree_Node root, const bool is_top);
+static void build_subtree(struct Tree_Segment *seg);
+static void build_local_node(struct Tree_Node node, const int first, 
+		const int npart, const int parent);
+static void link_top_node(const int i);
+static void copy_subtree(const struct Tree_Segment *seg);
+static inline int key_triplet(const int ipart, const int lvl);
+static inline int last_in_triplet(const int first, const int last, 
+		const int lvl);
+static inline int create_local_node();
+static void grow_node_pool(const int nNodes);
+static void build_blocks();
+static void find_bounds();
+static void fill_block(const int node);
+static inline void set_lane(struct Tree_Block *block, const int k, 
+		const int node);
+static inline int ngb_walk(const int ipart, const float hsml, 
+		int ngblist[NGBMAX], const bool symmetric);
+static inline int leaf_ngb(const int first, const int last, 
+		const float pos_i[3], const float hsml, const bool symmetric, 
+		int *ngblist, int ngbcnt);
+static void set_leaf_positions();
+static inline int group_ngb(const int ipart, const float hsml, 
+		int ngblist[NGBMAX], const bool symmetric);
+static void find_group_candidates(const int ipart, const float hsml, 
+		const bool symmetric);
+static inline bool inside_sphere(const struct Tree_Block *block, const int k,
+		const float pos[3], const float rad);
+static int find_leaf(const int ipart);
+static int leaf_partners(const int a, int *partner);
+static inline void add_candidate(const int jpart, const float hsml);
+static inline int open_children(const struct Tree_Block *block, 
+		const float pos_i[3], const float hsml, const bool symmetric, 
+		const float ext);
+static inline float node_distance2(const struct Tree_Block *block, 
+		const int k, const float pos_i[3]);
+static inline int first_particle(const struct Tree_Block *block, int k);
+static inline void swap_neighbours(int *ngblist, float *ngbdist, const int i,
+		const int j);
+static inline void set_node_geometry(struct Tree_Node *node, 
+		const struct Tree_Node *parent, const int ipart, const int triplet, 
+		const int lvl);
+void Select_nearest(int *ngblist, float *ngbdist, const int n, const int k);
 void Tree_Build();
+void Build_Tree_Type(const int type);
 void gravity_tree_init();
 int Level(const int node); 
 
 int Find_ngb_tree(const int ipart, const float hsml, int ngblist[NGBMAX])
+{
+	const int ngbcnt = ngb_walk(ipart, hsml, ngblist, false);
+
+	TREE_STAT(Ngbs_Found, ngbcnt);
+
+	return ngbcnt;
+}
+
+/*
+ * Find all particles j with r_ij < max(hsml, hsml_j), i.e. the gather and the
+ * scatter neighbours of ipart, in one walk. A node is opened if either 
+ * hsml or the largest hsml in the node reaches it. Needs Set_tree_hsml().
+ */
+
+int Find_ngb_tree_symmetric(const int ipart, const float hsml, 
+		int ngblist[NGBMAX])
+{
+	Assert(Ngb_Hsml != NULL, "Tree hsml not set, call Set_tree_hsml()");
+
+	const int ngbcnt = ngb_walk(ipart, hsml, ngblist, true);
+
+	TREE_STAT(Ngbs_Found, ngbcnt);
+
+	return ngbcnt;
+}
+
+static inline int ngb_walk(const int ipart, const float hsml, 
+		int ngblist[NGBMAX], const bool symmetric)
 {    
 	const float boxsize =  Param.Boxsize;
     const float boxhalf = Param.Boxsize * 0.5;
 	const float pos_i[3] = {P[ipart].Pos[0],P[ipart].Pos[1],P[ipart].Pos[2]};
 
-	int node = 1;
+	int stack[TREE_STACK_SIZE];
+	int nStack = 0;
+
+	stack[nStack++] = 0; // root
 
 	int ngbcnt = 0;
 
-	for (;;) {
-    	
-		float dx = fabs(pos_i[0] - Tree[node].Pos[0]);
-        float dy = fabs(pos_i[1] - Tree[node].Pos[1]);
-        float dz = fabs(pos_i[2] - Tree[node].Pos[2]);
-			
-        if (dx > boxhalf)
-	 	  	dx -= boxsize;
-		
-        if (dy > boxhalf)
-	 	  	dy -= boxsize;
-		
-        if (dz > boxhalf)
-	 	  	dz -= boxsize;
+	TREE_STAT(Queries, 1);
 
-		float dl = 0.5 * sqrt3 * Tree[node].Size + hsml;
+	while (nStack > 0) {
 		
-		if (dx*dx + dy*dy + dz*dz < dl*dl) {
+		const struct Tree_Block *block = &Block[stack[--nStack]];
 
-			if (Tree[node].DNext < 0) {
-			
-				int first = -(Tree[node].DNext + 1);
-				int last = first + Tree[node].Npart;
+		int open = open_children(block, pos_i, hsml, symmetric, 0);
 
-				for (int jpart = first; jpart < last; jpart++) { 
-				
-					float dx = fabs(pos_i[0] - P[jpart].Pos[0]);
-           			float dy = fabs(pos_i[1] - P[jpart].Pos[1]);
-           			float dz = fabs(pos_i[2] - P[jpart].Pos[2]);
+		TREE_STAT(Nodes_Opened, __builtin_popcount(open));
 
-        			if (dx > boxhalf)
-				 	  	dx -= boxsize;
+		while (open) {
 
-	        		if (dy > boxhalf)
-				 	  	dy -= boxsize;
+			int k = __builtin_ctz(open);
 
-			        if (dz > boxhalf)
-	 	  				dz -= boxsize;
+			open &= open - 1;
 
-					float dl = 0.5 * sqrt3 * Tree[node].Size + hsml;
+			if (block->Next[k] >= 0) { // internal node, walk later
 
-					if (dx*dx + dy*dy + dz*dz < hsml*hsml)
-						ngblist[ngbcnt++] = jpart;
+				__builtin_prefetch(&Block[block->Next[k]]);
+				
+				stack[nStack++] = block->Next[k];
 
-					if (ngbcnt == NGBMAX)
-						return ngbcnt;
-				}
+				continue;
 			}
 
-			node++; 
+			int first = -(block->Next[k] + 1);
+			int last = first + block->Npart[k];
+
+			TREE_STAT(Parts_Tested, last - first);
+
+			if (ngbcnt + last - first <= NGBMAX) { // no overflow possible
+
+				ngbcnt = leaf_ngb(first, last, pos_i, hsml, symmetric, 
+						ngblist, ngbcnt);
+
+				if (ngbcnt == NGBMAX)
+					return ngbcnt;
 
-			if (node >= NNodes) 
-				break;
-			else
 				continue;
-		} // if dx < dl 
+			}
+
+			for (int jpart = first; jpart < last; jpart++) { 
 				
-		node += max(1, Tree[node].DNext);
-		
-		if (node >= NNodes) 
-			break;
+				float dx = fabs(pos_i[0] - P[jpart].Pos[0]);
+           		float dy = fabs(pos_i[1] - P[jpart].Pos[1]);
+           		float dz = fabs(pos_i[2] - P[jpart].Pos[2]);
+
+        		if (dx > boxhalf)
+			 	  	dx -= boxsize;
+
+	        	if (dy > boxhalf)
+			 	  	dy -= boxsize;
+
+			    if (dz > boxhalf)
+	 	  			dz -= boxsize;
+
+				float h = hsml;
+
+				if (symmetric)
+					h = max(hsml, Ngb_Hsml[jpart] * Ngb_Hsml_Scale);
+
+				if (dx*dx + dy*dy + dz*dz < h*h)
+					ngblist[ngbcnt++] = jpart;
+
+				if (ngbcnt == NGBMAX)
+					return ngbcnt;
+			}
+		} 
 	}
 
 	return ngbcnt;
 }
 
-extern float Guess_hsml(const size_t ipart, const int DesNumNgb)
+/*
+ * Append the particles of a leaf inside the search sphere to ngblist, which 
+ * needs room for all of them. Positions come from the SoA copy, so a SIMD 
+ * register holds a block of particles. The periodic wrap is branch free and 
+ * the particles inside are compacted into ngblist with a masked store. The 
+ * arithmetic is the same as in the scalar loops, so are the neighbours.
+ */
+
+static inline int leaf_ngb(const int first, const int last, 
+		const float pos_i[3], const float hsml, const bool symmetric, 
+		int *ngblist, int ngbcnt)
 {
-	int node = P[ipart].Tree_Parent;
+	const float *x = Leaf_Pos[0] - Tree_First;
+	const float *y = Leaf_Pos[1] - Tree_First;
+	const float *z = Leaf_Pos[2] - Tree_First;
 
-    float numDens = Tree[node].Npart / p3(Tree[node].Size);
-    float size = pow( fourpithird/numDens, 1./3.);
-    
-	return 2 * size;
+#if defined(__AVX512F__)
+	const __m512 boxsize = _mm512_set1_ps(Param.Boxsize);
+	const __m512 px = _mm512_set1_ps(pos_i[0]);
+	const __m512 py = _mm512_set1_ps(pos_i[1]);
+	const __m512 pz = _mm512_set1_ps(pos_i[2]);
+	const __m512 h_i = _mm512_set1_ps(hsml);
+	const __m512 scale = _mm512_set1_ps(Ngb_Hsml_Scale);
+	const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 
+			11, 12, 13, 14, 15);
+
+	for (int start = first; start < last; start += 16) {
+
+		const __mmask16 valid = (1U << min(16, last - start)) - 1;
+
+		__m512 dx = _mm512_abs_ps(_mm512_sub_ps(px, 
+					_mm512_maskz_loadu_ps(valid, &x[start])));
+		__m512 dy = _mm512_abs_ps(_mm512_sub_ps(py, 
+					_mm512_maskz_loadu_ps(valid, &y[start])));
+		__m512 dz = _mm512_abs_ps(_mm512_sub_ps(pz, 
+					_mm512_maskz_loadu_ps(valid, &z[start])));
+
+		dx = _mm512_min_ps(dx, _mm512_sub_ps(boxsize, dx));
+		dy = _mm512_min_ps(dy, _mm512_sub_ps(boxsize, dy));
+		dz = _mm512_min_ps(dz, _mm512_sub_ps(boxsize, dz));
+
+		__m512 r2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), 
+					_mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz));
+
+		__m512 h = h_i;
+
+		if (symmetric)
+			h = _mm512_max_ps(h, _mm512_mul_ps(scale, 
+						_mm512_maskz_loadu_ps(valid, &Ngb_Hsml[start])));
+
+		__mmask16 inside = _mm512_mask_cmp_ps_mask(valid, r2, 
+				_mm512_mul_ps(h, h), _CMP_LT_OQ);
+
+		_mm512_mask_compressstoreu_epi32(&ngblist[ngbcnt], inside, 
+				_mm512_add_epi32(_mm512_set1_epi32(start), lane));
+
+		ngbcnt += __builtin_popcount(inside);
+	}
+#elif defined(__AVX2__)
+	const __m256 boxsize = _mm256_set1_ps(Param.Boxsize);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 px = _mm256_set1_ps(pos_i[0]);
+	const __m256 py = _mm256_set1_ps(pos_i[1]);
+	const __m256 pz = _mm256_set1_ps(pos_i[2]);
+	const __m256 h_i = _mm256_set1_ps(hsml);
+	const __m256 scale = _mm256_set1_ps(Ngb_Hsml_Scale);
+	const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i nibble = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+
+	for (int start = first; start < last; start += 8) {
+
+		const __m256i valid = _mm256_cmpgt_epi32(
+				_mm256_set1_epi32(last - start), lane);
+
+		__m256 dx = _mm256_andnot_ps(sign, _mm256_sub_ps(px, 
+					_mm256_maskload_ps(&x[start], valid)));
+		__m256 dy = _mm256_andnot_ps(sign, _mm256_sub_ps(py, 
+					_mm256_maskload_ps(&y[start], valid)));
+		__m256 dz = _mm256_andnot_ps(sign, _mm256_sub_ps(pz, 
+					_mm256_maskload_ps(&z[start], valid)));
+
+		dx = _mm256_min_ps(dx, _mm256_sub_ps(boxsize, dx));
+		dy = _mm256_min_ps(dy, _mm256_sub_ps(boxsize, dy));
+		dz = _mm256_min_ps(dz, _mm256_sub_ps(boxsize, dz));
+
+		__m256 r2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), 
+					_mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+
+		__m256 h = h_i;
+
+		if (symmetric)
+			h = _mm256_max_ps(h, _mm256_mul_ps(scale, 
+						_mm256_maskload_ps(&Ngb_Hsml[start], valid)));
+
+		const int inside = _mm256_movemask_ps(_mm256_and_ps(
+					_mm256_castsi256_ps(valid), 
+					_mm256_cmp_ps(r2, _mm256_mul_ps(h, h), _CMP_LT_OQ)));
+
+		const int n = __builtin_popcount(inside);
+
+		__m256i idx = _mm256_srlv_epi32(
+				_mm256_set1_epi32(Compress_Lut[inside]), nibble);
+
+		idx = _mm256_add_epi32(_mm256_and_si256(idx, _mm256_set1_epi32(0xF)),
+				_mm256_set1_epi32(start));
+
+		_mm256_maskstore_epi32(&ngblist[ngbcnt], 
+				_mm256_cmpgt_epi32(_mm256_set1_epi32(n), lane), idx);
+
+		ngbcnt += n;
+	}
+#else
+	const float boxsize = Param.Boxsize;
+
+	for (int jpart = first; jpart < last; jpart++) { // branch free
+
+		float dx = fabsf(pos_i[0] - x[jpart]);
+		float dy = fabsf(pos_i[1] - y[jpart]);
+		float dz = fabsf(pos_i[2] - z[jpart]);
+
+		dx = min(dx, boxsize - dx);
+		dy = min(dy, boxsize - dy);
+		dz = min(dz, boxsize - dz);
+
+		float h = hsml;
+
+		if (symmetric)
+			h = max(hsml, Ngb_Hsml[jpart] * Ngb_Hsml_Scale);
+
+		ngblist[ngbcnt] = jpart;
+
+		ngbcnt += dx*dx + dy*dy + dz*dz < h*h;
+	}
+#endif // __AVX512F__
+
+	return ngbcnt;
 }
 
+/*
+ * Copy the particle positions of the tree into SoA arrays for leaf_ngb().
+ */
 
-void Build_Tree()
+static void set_leaf_positions()
 {
-	gravity_tree_init();
-	
-	const double boxsize = Param.Boxsize;
+	if (Tree_Npart > Max_Leaf_Pos) {
 
-	create_node_from_particle(0, 0, 0, 0, &NNodes); // root node 
+		Max_Leaf_Pos = Tree_Npart;
 
-	Tree[0].Pos[0] = Tree[0].Pos[1] = Tree[0].Pos[2] = boxsize/2;
+		for (int i = 0; i < 3; i++)
+			Leaf_Pos[i] = Realloc(Leaf_Pos[i], 
+					Max_Leaf_Pos * sizeof(*Leaf_Pos[i]));
+	}
 
-	int last_parent = 0; // last parent of last particle
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < Tree_Npart; i++) {
 
-	double px = P[0].Pos[0]/boxsize;
-	double py = P[0].Pos[1]/boxsize;
-	double pz = P[0].Pos[2]/boxsize;
-		
-	peanoKey last_key = Reversed_Peano_Key(px, py, pz);
-	
-	last_key >>= 3; 
+		Leaf_Pos[0][i] = P[Tree_First + i].Pos[0];
+		Leaf_Pos[1][i] = P[Tree_First + i].Pos[1];
+		Leaf_Pos[2][i] = P[Tree_First + i].Pos[2];
+	}
 
-	for (int ipart = 1; ipart < Param.Npart[0]; ipart++) {
+#if defined(__AVX2__) && !defined(__AVX512F__)
+	for (int mask = 1; mask < 256; mask++) { // compaction table for AVX2
 
-		double px = P[ipart].Pos[0]/boxsize; 	
-		double py = P[ipart].Pos[1]/boxsize; 
-		double pz = P[ipart].Pos[2]/boxsize; 
-		
-		peanoKey key = Reversed_Peano_Key(px, py, pz);
+		uint32_t lut = 0;
 
-		int node = 0; // current node
-		int lvl = 0; // counts current level
-		int parent = 0; // parent of current node
+		for (int k = 7; k >= 0; k--)
+			if (mask & (1 << k))
+				lut = (lut << 4) | k;
 
-		while (lvl < N_PEANO_TRIPLETS) {
-			
-			if (particle_is_inside_node(key, lvl, node)) { // open node	
-				
-				if (Tree[node].Npart == 1) { // refine 
-	
-					Tree[node].DNext = 0;		
+		Compress_Lut[mask] = lut;
+	}
+#endif
+
+	return ;
+}
 
-					create_node_from_particle(ipart-1, node, last_key, lvl+1, 
-							&NNodes); // son of node
+/*
+ * Group walk: Peano neighbours visit almost the same nodes, so the tree is 
+ * walked once per leaf with the bounding sphere of the leaf. The candidates 
+ * are kept per thread and filtered for every particle of the leaf, until a 
+ * particle outside the leaf or a larger hsml is requested. Drop-in for 
+ * Find_ngb_tree(), fastest when consecutive particles are queried. 
+ */
 
-					last_key >>= 3;
-				}  
-				
-				add_particle_to_node(ipart, node); // add ipart to node
+int Find_ngb_group(const int ipart, const float hsml, int ngblist[NGBMAX])
+{
+	const int ngbcnt = group_ngb(ipart, hsml, ngblist, false);
 
-				parent = node;
+	TREE_STAT(Ngbs_Found, ngbcnt);
 
-				node++; // decline into node
+	return ngbcnt;
+}
 
-				lvl++;
-				
-				key >>= 3;
+int Find_ngb_group_symmetric(const int ipart, const float hsml, 
+		int ngblist[NGBMAX])
+{
+	Assert(Ngb_Hsml != NULL, "Tree hsml not set, call Set_tree_hsml()");
 
-			} else { // skip node
-				
-				if (Tree[node].DNext == 0 || node == NNodes - 1)   
-					break; // reached end of branch
-				
-				node += fmax(1, Tree[node].DNext);
-			}
-		} // while (lvl < 42)
-		
-		if (lvl > N_PEANO_TRIPLETS-1) {	// particles closer than PH resolution
-		
-			P[ipart].Tree_Parent = parent;
-			
-			continue; 					// tree cannot be deeper
-		}
+	const int ngbcnt = group_ngb(ipart, hsml, ngblist, true);
 
-		if (Tree[node].DNext == 0) 				// set DNext for internal node
-			Tree[node].DNext = NNodes - node; 	// only delta
-			
-		create_node_from_particle(ipart, parent, key, lvl, &NNodes); // sibling
-	
-		last_key = key >> 3;
-		last_parent = parent;
+	TREE_STAT(Ngbs_Found, ngbcnt);
 
-	} // for ipart
+	return ngbcnt;
+}
 
-	Tree[0].DNext = 0; 
+static inline int group_ngb(const int ipart, const float hsml, 
+		int ngblist[NGBMAX], const bool symmetric)
+{
+	if (ipart < Group.First || ipart >= Group.Last || hsml > Group.Hsml 
+			|| Group.Symmetric != symmetric || Group.Version != Tree_Version)
+		find_group_candidates(ipart, hsml * GROUP_HSML_FAC, symmetric);
 
-	int stack[N_PEANO_TRIPLETS + 1] = { 0 }; 
-	int lowest = 0;
+	const float boxsize = Param.Boxsize;
+	const float pos_i[3] = {P[ipart].Pos[0],P[ipart].Pos[1],P[ipart].Pos[2]};
 
-	for (int i = 1; i < NNodes; i++) {
-		
-		int lvl = Level(i);
+	int ngbcnt = 0;
 
-		while (lvl <= lowest) { // set pointers
+	TREE_STAT(Queries, 1);
+	TREE_STAT(Parts_Tested, Group.NCand);
 
-			int node = stack[lowest];
-	
-			if (node > 0)
-				Tree[node].DNext = i - node;
+	for (int start = 0; start < Group.NCand; start += GROUP_CHUNK) {
 
-			stack[lowest] = 0;
+		const int n = min(GROUP_CHUNK, Group.NCand - start);
 
-			lowest--;
-		} 
-		
-		if (Tree[i].DNext == 0) { // add node to stack
-			
-			stack[lvl] = i;
-			
-			lowest = lvl;
+		const int *cand = &Group.Cand[start];
+		const float *cand_x = &Group.Cand_Pos[0][start];
+		const float *cand_y = &Group.Cand_Pos[1][start];
+		const float *cand_z = &Group.Cand_Pos[2][start];
+		const float *cand_h = &Group.Cand_Hsml[start];
+
+		int inside[GROUP_CHUNK];
+
+		#pragma omp simd
+		for (int i = 0; i < n; i++) {
+
+			float dx = fabsf(pos_i[0] - cand_x[i]);
+			float dy = fabsf(pos_i[1] - cand_y[i]);
+			float dz = fabsf(pos_i[2] - cand_z[i]);
+
+			dx = min(dx, boxsize - dx);
+			dy = min(dy, boxsize - dy);
+			dz = min(dz, boxsize - dz);
+
+			float h = symmetric ? max(hsml, cand_h[i]) : hsml;
+
+			inside[i] = dx*dx + dy*dy + dz*dz < h*h;
 		}
-		
-	} // for
 
-	return ;
+		if (ngbcnt + n <= NGBMAX) { // branch free
+
+			for (int i = 0; i < n; i++) {
+
+				ngblist[ngbcnt] = cand[i];
+
+				ngbcnt += inside[i];
+			}
+
+			continue;
+		}
+
+		for (int i = 0; i < n; i++) {
+
+			if (ngbcnt == NGBMAX)
+				return ngbcnt;
+
+			if (inside[i])
+				ngblist[ngbcnt++] = cand[i];
+		}
+	}
+
+	return ngbcnt;
 }
 
-static inline bool particle_is_inside_node(const peanoKey key, const int lvl,		const int node)
+/*
+ * Count-only query: the kernel sums of the particles within hsml of ipart, 
+ * sum w(r/hsml) and sum u dw/du, see kernel_sums(), without a neighbour 
+ * list. The count is not limited by NGBMAX. Shares the candidates of the
+ * group walk, so the next list query of the leaf needs no walk. Returns the
+ * number of neighbours.
+ */
+
+int Find_ngb_weight(const int ipart, const float hsml, double *sum_wk,
+		double *sum_dwk)
 {
-	int part_triplet = key & 0x7;
+	if (ipart < Group.First || ipart >= Group.Last || hsml > Group.Hsml 
+			|| Group.Symmetric || Group.Version != Tree_Version)
+		find_group_candidates(ipart, hsml * GROUP_HSML_FAC, false);
+
+	const float boxsize = Param.Boxsize;
+	const float pos_i[3] = {P[ipart].Pos[0],P[ipart].Pos[1],P[ipart].Pos[2]};
+	const float h2 = hsml * hsml;
+
+	int ngbcnt = 0;
+
+	*sum_wk = *sum_dwk = 0;
+
+	TREE_STAT(Queries, 1);
+	TREE_STAT(Count_Queries, 1);
+	TREE_STAT(Parts_Tested, Group.NCand);
+
+	for (int start = 0; start < Group.NCand; start += GROUP_CHUNK) {
+
+		const int n = min(GROUP_CHUNK, Group.NCand - start);
+
+		const float *cand_x = &Group.Cand_Pos[0][start];
+		const float *cand_y = &Group.Cand_Pos[1][start];
+		const float *cand_z = &Group.Cand_Pos[2][start];
+
+		float r2[GROUP_CHUNK];
+
+		#pragma omp simd
+		for (int i = 0; i < n; i++) {
+
+			float dx = fabsf(pos_i[0] - cand_x[i]);
+			float dy = fabsf(pos_i[1] - cand_y[i]);
+			float dz = fabsf(pos_i[2] - cand_z[i]);
 
-	int node_triplet = key_fragment(node); 
+			dx = min(dx, boxsize - dx);
+			dy = min(dy, boxsize - dy);
+			dz = min(dz, boxsize - dz);
 
-	return (node_triplet == part_triplet); 
+			r2[i] = dx*dx + dy*dy + dz*dz;
+		}
+
+		int m = 0; 
+
+		for (int i = 0; i < n; i++) { // branch free, kernel only inside
+
+			r2[m] = r2[i];
+
+			m += r2[i] < h2;
+		}
+
+		KERNEL_SPECIALISE(kernel_sums, r2, m, hsml, sum_wk, sum_dwk);
+
+		ngbcnt += m;
+	}
+
+	TREE_STAT(Ngbs_Found, ngbcnt);
+
+	return ngbcnt;
 }
 
-static inline void create_node_from_particle(const int ipart,const int parent, 
-		const peanoKey key, const int lvl, int *NNodes)
+/*
+ * Collect all particles within hsml of the leaf of ipart, or within their
+ * own hsml in a symmetric walk. The leaf is enclosed in a sphere around its
+ * bounding box.
+ */
+
+static void find_group_candidates(const int ipart, const float hsml, 
+		const bool symmetric)
 {
-	const int node = (*NNodes)++;
+	const float boxsize =  Param.Boxsize;
+	const int leaf = find_leaf(ipart);
 
-	Assert(*NNodes < Max_Nodes, "Too many tree nodes %d \n", Max_Nodes);
+	Group.First = -(Tree[leaf].DNext + 1);
+	Group.Last = Group.First + Tree[leaf].Npart;
+	Group.Version = Tree_Version;
+	Group.Symmetric = symmetric;
+	Group.Hsml = hsml;
+	Group.NCand = 0;
 
-	Tree[node].DNext = -ipart - 1;
+	float pos[3] = { 0 }, rad = 0;
 
-	int keyfragment = (key & 0x7) << 6;
+	for (int i = 0; i < 3; i++) {
 
-	Tree[node].Bitfield = lvl | keyfragment;
+		pos[i] = 0.5 * (Bounds[leaf].Hi[i] + Bounds[leaf].Lo[i]);
 
-	const int sign[3] = { -1 + 2 * (P[ipart].Pos[0] > Tree[parent].Pos[0]),
-	 			     	  -1 + 2 * (P[ipart].Pos[1] > Tree[parent].Pos[1]),
-	 			          -1 + 2 * (P[ipart].Pos[2] > Tree[parent].Pos[2]) }; 
-	
-	float size = Param.Boxsize / (1 << lvl);
+		rad += p2(0.5 * (Bounds[leaf].Hi[i] - Bounds[leaf].Lo[i]));
+	}
+
+	rad = sqrt(rad) * (1 + 4*FLT_EPSILON) + 4 * FLT_EPSILON * boxsize;
+
+	int stack[TREE_STACK_SIZE];
+	int nStack = 0;
+
+	stack[nStack++] = 0; // root
+
+	while (nStack > 0) {
+		
+		const struct Tree_Block *block = &Block[stack[--nStack]];
+
+		int open = open_children(block, pos, hsml, symmetric, rad);
+
+		TREE_STAT(Nodes_Opened, __builtin_popcount(open));
+
+		while (open) {
+
+			int k = __builtin_ctz(open);
+
+			open &= open - 1;
+
+			if (block->Next[k] >= 0) { 
+
+				__builtin_prefetch(&Block[block->Next[k]]);
+				
+				stack[nStack++] = block->Next[k];
+
+				continue;
+			}
+
+			int first = -(block->Next[k] + 1);
+			int last = first + block->Npart[k];
+
+			if (inside_sphere(block, k, pos, hsml + rad)) {
+
+				for (int jpart = first; jpart < last; jpart++)
+					add_candidate(jpart, symmetric ? 
+							Ngb_Hsml[jpart] * Ngb_Hsml_Scale : 0);
+
+				continue;
+			}
+
+			TREE_STAT(Parts_Tested, last - first);
 
-	Tree[node].Size = size;
+			for (int jpart = first; jpart < last; jpart++) { 
+				
+				float dx = fabsf(pos[0] - P[jpart].Pos[0]);
+           		float dy = fabsf(pos[1] - P[jpart].Pos[1]);
+           		float dz = fabsf(pos[2] - P[jpart].Pos[2]);
+
+				dx = min(dx, boxsize - dx);
+				dy = min(dy, boxsize - dy);
+				dz = min(dz, boxsize - dz);
 
-	Tree[node].Pos[0] = Tree[parent].Pos[0] + sign[0] * size * 0.5;
-	Tree[node].Pos[1] = Tree[parent].Pos[1] + sign[1] * size * 0.5;
-	Tree[node].Pos[2] = Tree[parent].Pos[2] + sign[2] * size * 0.5;
+				float hsml_j = 0;
 
-	P[ipart].Tree_Parent = parent;
+				if (symmetric)
+					hsml_j = Ngb_Hsml[jpart] * Ngb_Hsml_Scale;
 
-	add_particle_to_node(ipart, node); 
+				if (dx*dx + dy*dy + dz*dz < p2(max(hsml, hsml_j) + rad))
+					add_candidate(jpart, hsml_j);
+			}
+		} 
+	}
 
 	return ;
 }
 
-static inline void add_particle_to_node(const int ipart, const int node)
+/*
+ * True if the bounding box of child k is completely inside the sphere
+ */
+
+static inline bool inside_sphere(const struct Tree_Block *block, const int k,
+		const float pos[3], const float rad)
 {
-	Tree[node].Npart++;
-	
-	return ;
+	const float boxsize = Param.Boxsize;
+
+	float dx = fabsf(pos[0] - block->Pos[0][k]);
+	float dy = fabsf(pos[1] - block->Pos[1][k]);
+	float dz = fabsf(pos[2] - block->Pos[2][k]);
+
+	dx = min(dx, boxsize - dx) + block->Ext[0][k];
+	dy = min(dy, boxsize - dy) + block->Ext[1][k];
+	dz = min(dz, boxsize - dz) + block->Ext[2][k];
+
+	return dx*dx + dy*dy + dz*dz < rad*rad;
 }
 
-static inline int key_fragment(const int node)
+/*
+ * Particles point to the parent of their leaf
+ */
+
+static int find_leaf(const int ipart)
 {
-	const uint32_t bitmask = 7UL << 6;
+	const int node = max(0, P[ipart].Tree_Parent);
+
+	if (Tree[node].DNext < 0)
+		return node;
+
+	const int last = node == 0 ? NNodes : node + Tree[node].DNext;
+
+	for (int child = node + 1; child < last; child += 
+			Tree[child].DNext < 0 ? 1 : Tree[child].DNext) {
+		
+		if (Tree[child].DNext >= 0)
+			continue;
 
-	return (Tree[node].Bitfield & bitmask) >> 6; // return bit 6-8
+		const int first = -(Tree[child].DNext + 1);
+
+		if (ipart >= first && ipart < first + Tree[child].Npart)
+			return child;
+	}
+
+	Assert(false, "No leaf found for particle %d, parent %d", ipart, node);
+
+	return -1;
 }
 
-int Level(const int node)
+static inline void add_candidate(const int jpart, const float hsml)
 {
-	return Tree[node].Bitfield & 0x3FUL; // return but 0-5
-}
+	if (Group.NCand == Group.Max_Cand) {
 
+		Group.Max_Cand = max(1024, 2 * Group.Max_Cand);
 
-void gravity_tree_init()
+		size_t nBytes = Group.Max_Cand * sizeof(*Group.Cand_Pos[0]);
+
+		Group.Cand = Realloc(Group.Cand, Group.Max_Cand * sizeof(*Group.Cand));
+		Group.Cand_Pos[0] = Realloc(Group.Cand_Pos[0], nBytes);
+		Group.Cand_Pos[1] = Realloc(Group.Cand_Pos[1], nBytes);
+		Group.Cand_Pos[2] = Realloc(Group.Cand_Pos[2], nBytes);
+		Group.Cand_Hsml = Realloc(Group.Cand_Hsml, nBytes);
+	}
+
+	const int i = Group.NCand++;
+
+	Group.Cand[i] = jpart;
+	Group.Cand_Pos[0][i] = P[jpart].Pos[0];
+	Group.Cand_Pos[1][i] = P[jpart].Pos[1];
+	Group.Cand_Pos[2][i] = P[jpart].Pos[2];
+	Group.Cand_Hsml[i] = hsml;
+
+	return ;
+}
+
+/*
+ * Sphere - box test of all 8 children of a block, bit k is set if child k 
+ * overlaps the search sphere. Periodic images are found via min(d,boxsize-d),
+ * the distance to the box is max(d - ext, 0) on every axis. In a symmetric
+ * walk the sphere radius is the larger of hsml and the node hsml. Group walks
+ * add the radius ext of the group.
+ */
+
+static inline int open_children(const struct Tree_Block *block, 
+		const float pos_i[3], const float hsml, const bool symmetric,
+		const float ext)
 {
-	Max_Nodes = Param.Npart[0] * NODES_PER_PARTICLE;
-	
-	size_t nBytes = Max_Nodes * sizeof(*Tree);
+#ifdef __AVX__
+	const __m256 boxsize = _mm256_set1_ps(Param.Boxsize);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 zero = _mm256_setzero_ps();
+
+	__m256 dx = _mm256_sub_ps(_mm256_set1_ps(pos_i[0]), 
+			_mm256_load_ps(block->Pos[0]));
+	__m256 dy = _mm256_sub_ps(_mm256_set1_ps(pos_i[1]), 
+			_mm256_load_ps(block->Pos[1]));
+	__m256 dz = _mm256_sub_ps(_mm256_set1_ps(pos_i[2]), 
+			_mm256_load_ps(block->Pos[2]));
+
+	dx = _mm256_andnot_ps(sign, dx); // fabs
+	dy = _mm256_andnot_ps(sign, dy);
+	dz = _mm256_andnot_ps(sign, dz);
+		
+	dx = _mm256_min_ps(dx, _mm256_sub_ps(boxsize, dx));
+	dy = _mm256_min_ps(dy, _mm256_sub_ps(boxsize, dy));
+	dz = _mm256_min_ps(dz, _mm256_sub_ps(boxsize, dz));
 
-	if (Tree == NULL)
-		Tree = malloc(nBytes);
-	
-	memset(Tree, 0, nBytes);
+	dx = _mm256_max_ps(_mm256_sub_ps(dx, _mm256_load_ps(block->Ext[0])), zero);
+	dy = _mm256_max_ps(_mm256_sub_ps(dy, _mm256_load_ps(block->Ext[1])), zero);
+	dz = _mm256_max_ps(_mm256_sub_ps(dz, _mm256_load_ps(block->Ext[2])), zero);
 
-	NNodes = 0;
+	__m256 r2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), 
+			_mm256_add_ps(_mm256_mul_ps(dy, dy), _mm256_mul_ps(dz, dz)));
+
+	__m256 h = _mm256_set1_ps(hsml);
+
+	if (symmetric)
+		h = _mm256_max_ps(h, _mm256_load_ps(block->Hsml));
+
+	h = _mm256_add_ps(h, _mm256_set1_ps(ext));
+
+	__m256 open = _mm256_cmp_ps(r2, _mm256_mul_ps(h, h), _CMP_LT_OQ);
+
+	return _mm256_movemask_ps(open);
+#elif defined(__SSE2__)
+	const __m128 boxsize = _mm_set1_ps(Param.Boxsize);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 px = _mm_set1_ps(pos_i[0]);
+	const __m128 py = _mm_set1_ps(pos_i[1]);
+	const __m128 pz = _mm_set1_ps(pos_i[2]);
+
+	int open = 0;
+
+	for (int k = 0; k < 8; k += 4) {
+
+		__m128 h = _mm_set1_ps(hsml);
+
+		if (symmetric)
+			h = _mm_max_ps(h, _mm_load_ps(&block->Hsml[k]));
+
+		h = _mm_add_ps(h, _mm_set1_ps(ext));
+
+		__m128 dx = _mm_andnot_ps(sign, _mm_sub_ps(px, 
+					_mm_load_ps(&block->Pos[0][k])));
+		__m128 dy = _mm_andnot_ps(sign, _mm_sub_ps(py, 
+					_mm_load_ps(&block->Pos[1][k])));
+		__m128 dz = _mm_andnot_ps(sign, _mm_sub_ps(pz, 
+					_mm_load_ps(&block->Pos[2][k])));
+
+		dx = _mm_min_ps(dx, _mm_sub_ps(boxsize, dx));
+		dy = _mm_min_ps(dy, _mm_sub_ps(boxsize, dy));
+		dz = _mm_min_ps(dz, _mm_sub_ps(boxsize, dz));
+
+		dx = _mm_max_ps(_mm_sub_ps(dx, _mm_load_ps(&block->Ext[0][k])), zero);
+		dy = _mm_max_ps(_mm_sub_ps(dy, _mm_load_ps(&block->Ext[1][k])), zero);
+		dz = _mm_max_ps(_mm_sub_ps(dz, _mm_load_ps(&block->Ext[2][k])), zero);
+
+		__m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), 
+				_mm_add_ps(_mm_mul_ps(dy, dy), _mm_mul_ps(dz, dz)));
+
+		__m128 lane = _mm_cmplt_ps(r2, _mm_mul_ps(h, h));
+
+		open |= _mm_movemask_ps(lane) << k;
+	}
+
+	return open;
+#else
+	int open = 0;
+
+	#pragma omp simd reduction(|:open)
+	for (int k = 0; k < 8; k++) {
+
+		float h = (symmetric ? max(hsml, block->Hsml[k]) : hsml) + ext;
+
+		open |= (node_distance2(block, k, pos_i) < h*h) << k;
+	}
+
+	return open;
+#endif // __AVX__
+}
+
+/*
+ * Find the k nearest neighbours of ipart in one walk. Candidates inside the 
+ * search radius are queued, when there are 2k of them, we keep the k nearest
+ * and shrink the search radius to the k-th distance. Children are visited 
+ * closest first, so the radius shrinks fast. On return ngbdist holds the 
+ * distances, the k-th nearest neighbour is last, the rest is unordered.
+ */
+
+int Find_knn_tree(const int ipart, const int k, int ngblist[NGBMAX], 
+		float ngbdist[NGBMAX])
+{
+	Assert(k > 0 && 2*k <= NGBMAX, "Can't find %d nearest neighbours, max %d",
+			k, NGBMAX/2);
+
+	const float boxsize = Param.Boxsize;
+	const float pos_i[3] = {P[ipart].Pos[0],P[ipart].Pos[1],P[ipart].Pos[2]};
+
+	int stack[TREE_STACK_SIZE];
+	int nStack = 0;
+
+	stack[nStack++] = 0; // root
+
+	int ngbcnt = 0; // ngbdist holds r^2 until the end
+
+	float r2max = p2(boxsize); // search radius squared
+
+	TREE_STAT(Queries, 1);
+
+	while (nStack > 0) {
+		
+		const struct Tree_Block *block = &Block[stack[--nStack]];
+
+		int open = open_children(block, pos_i, sqrt(r2max), false, 0);
+
+		TREE_STAT(Nodes_Opened, __builtin_popcount(open));
+
+		int lane[8] = { 0 };
+		float d2[8] = { 0 };
+		int nOpen = 0;
+
+		while (open) { // sort opened children by distance
+			
+			int i = __builtin_ctz(open);
+
+			open &= open - 1;
+
+			float r2 = node_distance2(block, i, pos_i);
+
+			int j = nOpen++;
+
+			for (; j > 0 && d2[j-1] > r2; j--) {
+				
+				lane[j] = lane[j-1];
+				d2[j] = d2[j-1];
+			}
+
+			lane[j] = i;
+			d2[j] = r2;
+		}
+
+		for (int j = 0; j < nOpen; j++) { // leaves, closest first
+		
+			if (block->Next[lane[j]] >= 0)
+				continue;
+
+			int first = -(block->Next[lane[j]] + 1);
+			int last = first + block->Npart[lane[j]];
+
+			TREE_STAT(Parts_Tested, last - first);
+
+			for (int jpart = first; jpart < last; jpart++) { 
+				
+				float dx = fabsf(pos_i[0] - P[jpart].Pos[0]);
+           		float dy = fabsf(pos_i[1] - P[jpart].Pos[1]);
+           		float dz = fabsf(pos_i[2] - P[jpart].Pos[2]);
+
+				dx = min(dx, boxsize - dx);
+				dy = min(dy, boxsize - dy);
+				dz = min(dz, boxsize - dz);
+
+				float r2 = dx*dx + dy*dy + dz*dz;
+
+				if (r2 >= r2max)
+					continue;
+
+				ngblist[ngbcnt] = jpart;
+				ngbdist[ngbcnt] = r2;
+
+				if (++ngbcnt == 2*k) { // shrink search radius
+
+					Select_nearest(ngblist, ngbdist, ngbcnt, k);
+
+					ngbcnt = k;
+
+					r2max = ngbdist[k-1];
+				}
+			}
+		}
+
+		for (int j = nOpen - 1; j >= 0; j--) { // internal nodes, closest last
+		
+			const int i = lane[j];
+
+			if (block->Next[i] < 0)
+				continue;
+			
+			if (d2[j] >= r2max) // radius shrunk
+				continue;
+
+			__builtin_prefetch(&Block[block->Next[i]]);
+			
+			stack[nStack++] = block->Next[i];
+		}
+	}
+
+	if (ngbcnt > 0) {
+
+		Select_nearest(ngblist, ngbdist, ngbcnt, min(k, ngbcnt));
+
+		ngbcnt = min(k, ngbcnt);
+	}
+
+	for (int i = 0; i < ngbcnt; i++)
+		ngbdist[i] = sqrt(ngbdist[i]);
+
+	TREE_STAT(Ngbs_Found, ngbcnt);
+
+	return ngbcnt;
+}
+
+/*
+ * Find all particles of the tree with rmin <= r < rmax from pos, which can be
+ * any point in the box, e.g. a halo centre. Nodes completely inside the shell
+ * are taken without testing their particles, nodes inside rmin are skipped.
+ * With list == NULL we only count, else *list is reallocated to hold the
+ * particles and has to be freed by the caller.
+ */
+
+int Find_shell_tree(const float pos[3], const float rmin, const float rmax,
+		int **list)
+{
+	const float boxsize = Param.Boxsize;
+
+	int stack[TREE_STACK_SIZE];
+	int nStack = 0;
+
+	stack[nStack++] = 0; // root
+
+	int cnt = 0, max_cnt = 0;
+
+	TREE_STAT(Queries, 1);
+
+	while (nStack > 0) {
+
+		const struct Tree_Block *block = &Block[stack[--nStack]];
+
+		int open = open_children(block, pos, rmax, false, 0);
+
+		TREE_STAT(Nodes_Opened, __builtin_popcount(open));
+
+		while (open) {
+
+			const int k = __builtin_ctz(open);
+
+			open &= open - 1;
+
+			if (inside_sphere(block, k, pos, rmin)) // in the hole
+				continue;
+
+			const bool whole = inside_sphere(block, k, pos, rmax) 
+				&& node_distance2(block, k, pos) >= rmin*rmin;
+
+			if (!whole && block->Next[k] >= 0) { // internal node, walk later
+
+				stack[nStack++] = block->Next[k];
+
+				continue;
+			}
+
+			const int first = first_particle(block, k);
+			const int last = first + block->Npart[k];
+
+			if (list != NULL && cnt + last - first > max_cnt) {
+
+				max_cnt = max(2 * max_cnt, cnt + last - first);
+
+				*list = Realloc(*list, max_cnt * sizeof(**list));
+			}
+
+			if (whole) {
+
+				if (list != NULL)
+					for (int jpart = first; jpart < last; jpart++)
+						(*list)[cnt++] = jpart;
+				else 
+					cnt += last - first;
+
+				continue;
+			}
+
+			TREE_STAT(Parts_Tested, last - first);
+
+			for (int jpart = first; jpart < last; jpart++) {
+
+				float dx = fabsf(pos[0] - P[jpart].Pos[0]);
+				float dy = fabsf(pos[1] - P[jpart].Pos[1]);
+				float dz = fabsf(pos[2] - P[jpart].Pos[2]);
+
+				dx = min(dx, boxsize - dx);
+				dy = min(dy, boxsize - dy);
+				dz = min(dz, boxsize - dz);
+
+				const float r2 = dx*dx + dy*dy + dz*dz;
+
+				if (r2 < rmin*rmin || r2 >= rmax*rmax)
+					continue;
+
+				if (list != NULL)
+					(*list)[cnt] = jpart;
+
+				cnt++;
+			}
+		}
+	}
+
+	TREE_STAT(Ngbs_Found, cnt);
+
+	return cnt;
+}
+
+int Find_ball_tree(const float pos[3], const float r, int **list)
+{
+	return Find_shell_tree(pos, 0, r, list);
+}
+
+/*
+ * Shell queries around n centres in parallel, the cnt[i] particles of centre
+ * i go to list[i] like in Find_shell_tree(). rmin == NULL gives balls, 
+ * list == NULL only counts.
+ */
+
+void Find_shell_tree_batch(const int n, float pos[][3], const float *rmin, 
+		const float *rmax, int *cnt, int **list)
+{
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int i = 0; i < n; i++)
+		cnt[i] = Find_shell_tree(pos[i], rmin == NULL ? 0 : rmin[i], rmax[i],
+				list == NULL ? NULL : &list[i]);
+
+	return ;
+}
+
+/*
+ * The particles of a node are contiguous, the first one is in the leaf 
+ * reached through the first children.
+ */
+
+static inline int first_particle(const struct Tree_Block *block, int k)
+{
+	while (block->Next[k] >= 0) {
+
+		block = &Block[block->Next[k]];
+
+		k = 0;
+	}
+
+	return -(block->Next[k] + 1);
+}
+
+/*
+ * Squared distance of pos_i to the bounding box of child k, 0 inside
+ */
+
+static inline float node_distance2(const struct Tree_Block *block, 
+		const int k, const float pos_i[3])
+{
+	const float boxsize = Param.Boxsize;
+
+	float dx = fabsf(pos_i[0] - block->Pos[0][k]);
+	float dy = fabsf(pos_i[1] - block->Pos[1][k]);
+	float dz = fabsf(pos_i[2] - block->Pos[2][k]);
+
+	dx = min(dx, boxsize - dx);
+	dy = min(dy, boxsize - dy);
+	dz = min(dz, boxsize - dz);
+
+	dx = max(dx - block->Ext[0][k], 0);
+	dy = max(dy - block->Ext[1][k], 0);
+	dz = max(dz - block->Ext[2][k], 0);
+
+	return dx*dx + dy*dy + dz*dz;
+}
+
+/*
+ * Partially sort so that the k nearest come first and the k-th nearest is 
+ * at k-1 (Wirth 1976)
+ */
+
+void Select_nearest(int *ngblist, float *ngbdist, const int n, const int k)
+{
+	int lo = 0, hi = n - 1;
+
+	while (lo < hi) {
+
+		const float pivot = ngbdist[k-1];
+
+		int i = lo, j = hi;
+
+		do {
+
+			while (ngbdist[i] < pivot) 
+				i++;
+
+			while (pivot < ngbdist[j]) 
+				j--;
+
+			if (i <= j) {
+				
+				swap_neighbours(ngblist, ngbdist, i, j);
+
+				i++;
+				j--;
+			}
+
+		} while (i <= j);
+
+		if (j < k-1) 
+			lo = i;
+
+		if (k-1 < i) 
+			hi = j;
+	}
+
+	return ;
+}
+
+static inline void swap_neighbours(int *ngblist, float *ngbdist, const int i,
+		const int j)
+{
+	const int itmp = ngblist[i];
+	const float ftmp = ngbdist[i];
+
+	ngblist[i] = ngblist[j];
+	ngbdist[i] = ngbdist[j];
+
+	ngblist[j] = itmp;
+	ngbdist[j] = ftmp;
+
+	return ;
+}
+
+extern float Guess_hsml(const size_t ipart, const int DesNumNgb)
+{
+	int node = P[ipart].Tree_Parent;
+
+    float numDens = Tree[node].Npart / p3(Tree[node].Size);
+    float size = pow( fourpithird/numDens, 1./3.);
+    
+	return 2 * size;
+}
+
+void Build_Tree()
+{
+	Build_Tree_Type(0);
+
+	return ;
+}
+
+/* 
+ * The tree is built top down in parallel: Above a domain level, the top nodes
+ * are found serially from the Peano order of the particles. Each of the 
+ * subtrees below is built by one thread into its own buffer, then all 
+ * segments are stitched into Tree in depth first order. Pointers inside a 
+ * subtree are relative, so only particle parents and the top nodes have to 
+ * be fixed. Nodes with at most TREE_LEAF_SIZE particles are not refined.
+ * The tree holds the particles of one type, which have to be Peano sorted.
+ */
+
+void Build_Tree_Type(const int type)
+{
+	Tree_First = 0;
+
+	for (int i = 0; i < type; i++)
+		Tree_First += Param.Npart[i];
+
+	Tree_Npart = Param.Npart[type];
+
+	gravity_tree_init();
+
+	const int domain_lvl = domain_level();
+
+	struct Tree_Node root = { 0 }; 
+
+	root.Size = Param.Boxsize;
+	root.Pos[0] = root.Pos[1] = root.Pos[2] = Param.Boxsize/2;
+
+	NSeg = 0;
+
+	find_segments(Tree_First, Tree_Npart, 0, -1, root, domain_lvl);
+
+	#pragma omp parallel
+	{
+
+	Local_NNodes = 0;
+
+	#pragma omp for schedule(dynamic, 1)
+	for (int i = 0; i < NSeg; i++) 
+		if (! Seg[i].Is_Top)
+			build_subtree(&Seg[i]);
+
+	#pragma omp single
+	{
+
+	for (int i = 0; i < NSeg; i++) {
+
+		Seg[i].Offset = NNodes;
+
+		NNodes += Seg[i].NNodes;
+	}
+
+	grow_node_pool(NNodes);
+
+	for (int i = 0; i < NSeg; i++) 
+		if (Seg[i].Is_Top)
+			link_top_node(i);
+
+	} // omp single
+
+	const int thread_id = omp_get_thread_num();
+
+	for (int i = 0; i < NSeg; i++) // every thread copies its own segments
+		if ((! Seg[i].Is_Top) && (Seg[i].ThreadID == thread_id))
+			copy_subtree(&Seg[i]);
+
+	} // omp parallel
+
+	Tree[0].DNext = 0; 
+
+	build_blocks();
+
+	set_leaf_positions();
+
+	Tree_Version++;
+
+	Invalidate_ngb_cache(); // particles moved
+
+	return ;
+}
+
+/* 
+ * The domain level has at least TOP_SEGMENTS_PER_THREAD cells per thread
+ */
+
+static int domain_level()
+{
+	int lvl = 0;
+
+	while ((1UL << (3*lvl)) < TOP_SEGMENTS_PER_THREAD * Omp.NThreads)
+		lvl++;
+
+	return lvl;
+}
+
+/*
+ * Recursively split particle range into the top nodes and the subtrees below 
+ * the domain level. 
+ */
+
+static void find_segments(const int first, const int npart, const int lvl, 
+		const int parent, struct Tree_Node node, const int domain_lvl)
+{
+	if (npart <= TREE_LEAF_SIZE || lvl == domain_lvl) { 
+		
+		add_segment(first, npart, parent, node, false);
+
+		return ;
+	}
+
+	node.DNext = 0;
+	node.Npart = npart;
+
+	const int seg = NSeg;
+	
+	add_segment(first, npart, parent, node, true);
+
+	const int last = first + npart;
+
+	for (int start = first; start < last;) {
+
+		const int triplet = key_triplet(start, lvl+1);
+		const int end = last_in_triplet(start, last, lvl+1);
+
+		struct Tree_Node child = { 0 };
+
+		set_node_geometry(&child, &node, start, triplet, lvl+1);
+
+		find_segments(start, end-start, lvl+1, seg, child, domain_lvl);
+		
+		start = end;
+	}
+
+	return ;
+}
+
+static void add_segment(const int first, const int npart, const int parent,
+		const struct Tree_Node root, const bool is_top)
+{
+	if (NSeg == Max_Seg) {
+	
+		Max_Seg = max(1024, 2 * Max_Seg);
+
+		Seg = Realloc(Seg, Max_Seg * sizeof(*Seg));
+	}
+	
+	Seg[NSeg].First = first;
+	Seg[NSeg].Npart = npart;
+	Seg[NSeg].Parent = parent;
+	Seg[NSeg].Is_Top = is_top;
+	Seg[NSeg].Root = root;
+	Seg[NSeg].NNodes = 1;
+	Seg[NSeg].ThreadID = -1;
+
+	NSeg++;
+
+	return ;
+}
+
+static void build_subtree(struct Tree_Segment *seg)
+{
+	seg->ThreadID = omp_get_thread_num();
+	seg->Local_Offset = Local_NNodes;
+
+	build_local_node(seg->Root, seg->First, seg->Npart, -1);
+
+	seg->NNodes = Local_NNodes - seg->Local_Offset;
+
+	return ;
+}
+
+/* 
+ * Add node and its children depth first to the thread local tree. Internal
+ * nodes point behind their subtree, leaves to their first particle.
+ */
+
+static void build_local_node(struct Tree_Node node, const int first, 
+		const int npart, const int parent)
+{
+	const int lvl = node.Bitfield & 0x3FUL;
+
+	const int inode = create_local_node();
+
+	node.Npart = npart;
+
+	if (npart <= TREE_LEAF_SIZE || lvl == N_PEANO_TRIPLETS) { // leaf
+
+		node.DNext = -first - 1;
+
+		Local_Tree[inode] = node;
+
+		for (int ipart = first; ipart < first + npart; ipart++)
+			P[ipart].Tree_Parent = parent;
+
+		return ;
+	}
+
+	node.DNext = 0;
+
+	Local_Tree[inode] = node;
+
+	const int last = first + npart;
+
+	for (int start = first; start < last;) { // children
+
+		const int triplet = key_triplet(start, lvl+1);
+		const int end = last_in_triplet(start, last, lvl+1);
+
+		struct Tree_Node child = { 0 };
+
+		set_node_geometry(&child, &node, start, triplet, lvl+1);
+
+		build_local_node(child, start, end-start, inode);
+		
+		start = end;
+	}
+
+	Local_Tree[inode].DNext = Local_NNodes - inode; 
+
+	return ;
+}
+
+/*
+ * Top nodes point to the next segment on the same or a higher level
+ */
+
+static void link_top_node(const int i)
+{
+	const int node = Seg[i].Offset;
+	const int lvl = Seg[i].Root.Bitfield & 0x3FUL;
+
+	Tree[node] = Seg[i].Root;
+
+	Tree[node].DNext = NNodes - node;
+
+	for (int j = i + 1; j < NSeg; j++) {
+		
+		if ((Seg[j].Root.Bitfield & 0x3FUL) <= lvl) {
+		
+			Tree[node].DNext = Seg[j].Offset - node;
+
+			break;
+		}
+	}
+
+	return ;
+}
+
+static void copy_subtree(const struct Tree_Segment *seg)
+{
+	memcpy(&Tree[seg->Offset], &Local_Tree[seg->Local_Offset], 
+			seg->NNodes * sizeof(*Tree));
+
+	const int first = seg->First;
+	const int last = seg->First + seg->Npart;
+	
+	if (seg->NNodes == 1) { // single leaf, parent is a top node
+
+		int parent = 0;
+
+		if (seg->Parent >= 0)
+			parent = Seg[seg->Parent].Offset;
+
+		for (int ipart = first; ipart < last; ipart++)
+			P[ipart].Tree_Parent = parent;
+
+		return ;
+	}
+
+	const int delta = seg->Offset - seg->Local_Offset;
+
+	for (int ipart = first; ipart < last; ipart++)
+		P[ipart].Tree_Parent += delta;
+
+	return ;
+}
+
+/* 
+ * Return the key triplet of level lvl from the Peano key. Level 1 starts at 
+ * bit 125, level 0 is not stored.
+ */
+
+static inline int key_triplet(const int ipart, const int lvl)
+{
+	return (P[ipart].Key >> (3*(N_PEANO_TRIPLETS - lvl) + 2)) & 0x7;
+}
+
+/*
+ * Particles are Peano sorted, so in every node the key triplets of the next 
+ * level are ordered. Find the end of the first child by bisection.
+ */
+
+static inline int last_in_triplet(const int first, const int last, 
+		const int lvl)
+{
+	const int triplet = key_triplet(first, lvl);
+
+	int lo = first, hi = last; 
+
+	while (hi - lo > 1) { // triplet(lo) == triplet, triplet(hi) != triplet 
+			
+		int mid = lo + (hi - lo)/2;
+
+		if (key_triplet(mid, lvl) == triplet)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return hi;
+}
+
+static inline int create_local_node()
+{
+	if (Local_NNodes == Local_Max_Nodes) {
+
+		Local_Max_Nodes = max(1024, 2 * Local_Max_Nodes);
+
+		Local_Tree = Realloc(Local_Tree, Local_Max_Nodes * sizeof(*Local_Tree));
+	}
+
+	return Local_NNodes++;
+}
+
+static inline void set_node_geometry(struct Tree_Node *node, 
+		const struct Tree_Node *parent, const int ipart, const int triplet, 
+		const int lvl)
+{
+	node->Bitfield = lvl | (triplet << 6);
+
+	const int sign[3] = { -1 + 2 * (P[ipart].Pos[0] >= parent->Pos[0]),
+	 			     	  -1 + 2 * (P[ipart].Pos[1] >= parent->Pos[1]),
+	 			          -1 + 2 * (P[ipart].Pos[2] >= parent->Pos[2]) }; 
+	
+	float size = Param.Boxsize / (1 << lvl);
+
+	node->Size = size;
+
+	node->Pos[0] = parent->Pos[0] + sign[0] * size * 0.5;
+	node->Pos[1] = parent->Pos[1] + sign[1] * size * 0.5;
+	node->Pos[2] = parent->Pos[2] + sign[2] * size * 0.5;
+
+	return ;
+}
+
+/* 
+ * Collect the children of all internal nodes into blocks, in depth first 
+ * order. Block 0 holds only the root. Empty lanes have a negative box size,
+ * so their distance is infinite and they never open.
+ */
+
+static void build_blocks()
+{
+	Node_Block = Realloc(Node_Block, NNodes * sizeof(*Node_Block));
+
+	NBlocks = 1;
+
+	for (int node = 0; node < NNodes; node++) 
+		if (Tree[node].DNext >= 0) // internal node 
+			Node_Block[node] = NBlocks++;
+	
+	if (NBlocks > Max_Blocks) { // cache line aligned
+
+		if (Block_Memory != NULL)
+			Free(Block_Memory);
+
+		Max_Blocks = NBlocks * 1.2;
+
+		Block_Memory = Malloc(Max_Blocks * sizeof(*Block) + 64);
+
+		Block = (struct Tree_Block *) (((uintptr_t) Block_Memory + 63) & ~63);
+	}
+
+	find_bounds();
+
+	memset(&Block[0], 0, sizeof(*Block));
+
+	for (int k = 0; k < 8; k++)
+		Block[0].Ext[0][k] = Block[0].Ext[1][k] = Block[0].Ext[2][k] = -FLT_MAX;
+
+	set_lane(&Block[0], 0, 0);
+
+	Block[0].Next[0] = Tree[0].DNext < 0 ? Tree[0].DNext : Node_Block[0];
+
+	Ngb_Hsml = NULL; // node hsml are invalid now
+
+	#pragma omp parallel for schedule(static)
+	for (int node = 0; node < NNodes; node++) 
+		if (Tree[node].DNext >= 0)
+			fill_block(node);
+
+	return ;
+}
+
+/*
+ * Update the tree after small particle displacements: The topology and the 
+ * particle order are kept, only the bounding boxes are recomputed. Particles
+ * that left their cell just grow the box of their leaf, so the walk stays 
+ * exact, but gets slower the further particles move. Then sort and rebuild.
+ */
+
+void Refit_Tree()
+{
+	find_bounds();
+
+	set_leaf_positions();
+
+	set_lane(&Block[0], 0, 0);
+
+	#pragma omp parallel for schedule(static)
+	for (int node = 0; node < NNodes; node++) 
+		if (Tree[node].DNext >= 0)
+			fill_block(node);
+
+	Ngb_Hsml = NULL; 
+
+	Tree_Version++;
+
+	Invalidate_ngb_cache();
+
+	return ;
+}
+
+static void fill_block(const int node)
+{
+	struct Tree_Block *block = &Block[Node_Block[node]];
+
+	const int last = node == 0 ? NNodes : node + Tree[node].DNext;
+
+	int k = 0;
+
+	for (int child = node + 1; child < last; k++) {
+
+		Assert(k < 8, "Node %d has more than 8 children", node);
+
+		set_lane(block, k, child);
+
+		if (Tree[child].DNext < 0) { // leaf
+			
+			block->Next[k] = Tree[child].DNext;
+
+			child++;
+
+		} else {
+			
+			block->Next[k] = Node_Block[child];
+
+			child += Tree[child].DNext;
+		}
+	}
+
+	for (; k < 8; k++) { // empty lanes never open
+		
+		block->Pos[0][k] = block->Pos[1][k] = block->Pos[2][k] = 0;
+		block->Ext[0][k] = block->Ext[1][k] = block->Ext[2][k] = -FLT_MAX;
+		block->Next[k] = block->Npart[k] = 0;
+		block->Hsml[k] = 0;
+	}
+
+	return ;
+}
+
+static inline void set_lane(struct Tree_Block *block, const int k, 
+		const int node)
+{
+	const float pad = 4 * FLT_EPSILON * Param.Boxsize; // rounding in the test
+
+	for (int i = 0; i < 3; i++) {
+
+		block->Pos[i][k] = 0.5 * (Bounds[node].Hi[i] + Bounds[node].Lo[i]);
+		block->Ext[i][k] = 0.5 * (Bounds[node].Hi[i] - Bounds[node].Lo[i]) 
+			+ pad;
+	}
+
+	block->Npart[k] = Tree[node].Npart;
+
+	return ;
+}
+
+/*
+ * Find the bounding boxes of the particles in all nodes. Leaves in parallel,
+ * internal nodes bottom up from the end of the depth first order. After a 
+ * refit, particles may have left their cell through the periodic boundary,
+ * so we take the image closest to the cell centre. 
+ */
+
+static void find_bounds()
+{
+	const float boxsize = Param.Boxsize;
+	const float boxhalf = Param.Boxsize * 0.5;
+
+	Bounds = Realloc(Bounds, NNodes * sizeof(*Bounds));
+
+	#pragma omp parallel for schedule(static)
+	for (int node = 0; node < NNodes; node++) {
+
+		if (Tree[node].DNext >= 0)
+			continue;
+
+		const int first = -(Tree[node].DNext + 1);
+		const int last = first + Tree[node].Npart;
+
+		struct Node_Bounds b = { { FLT_MAX, FLT_MAX, FLT_MAX }, 
+								 { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+
+		for (int ipart = first; ipart < last; ipart++) {
+
+			for (int i = 0; i < 3; i++) {
+
+				float x = P[ipart].Pos[i];
+
+				if (x - Tree[node].Pos[i] > boxhalf)
+					x -= boxsize;
+
+				if (x - Tree[node].Pos[i] < -boxhalf)
+					x += boxsize;
+
+				b.Lo[i] = min(b.Lo[i], x);
+				b.Hi[i] = max(b.Hi[i], x);
+			}
+		}
+
+		Bounds[node] = b;
+	}
+
+	for (int node = NNodes - 1; node >= 0; node--) { // children first
+
+		if (Tree[node].DNext < 0)
+			continue;
+
+		const int last = node == 0 ? NNodes : node + Tree[node].DNext;
+
+		struct Node_Bounds b = Bounds[node + 1];
+
+		for (int child = node + 1; child < last;) {
+
+			for (int i = 0; i < 3; i++) {
+
+				b.Lo[i] = min(b.Lo[i], Bounds[child].Lo[i]);
+				b.Hi[i] = max(b.Hi[i], Bounds[child].Hi[i]);
+			}
+
+			child += Tree[child].DNext < 0 ? 1 : Tree[child].DNext;
+		}
+
+		Bounds[node] = b;
+	}
+
+	return ;
+}
+
+/*
+ * Store the largest hsml of every node in the blocks for the symmetric walk.
+ * hsml is indexed by particle, hsml*scale is a length. Leaves are set in 
+ * parallel, internal nodes bottom up from the end of the depth first order.
+ */
+
+void Set_tree_hsml(const float *hsml, const float scale)
+{
+	Node_Hsml = Realloc(Node_Hsml, NNodes * sizeof(*Node_Hsml));
+
+	#pragma omp parallel for schedule(static)
+	for (int node = 0; node < NNodes; node++) {
+
+		if (Tree[node].DNext >= 0)
+			continue;
+
+		const int first = -(Tree[node].DNext + 1);
+		const int last = first + Tree[node].Npart;
+
+		float hmax = 0;
+
+		for (int ipart = first; ipart < last; ipart++)
+			hmax = max(hmax, hsml[ipart]);
+
+		Node_Hsml[node] = hmax * scale;
+	}
+
+	for (int node = NNodes - 1; node >= 0; node--) { // children first
+
+		if (Tree[node].DNext < 0)
+			continue;
+
+		struct Tree_Block *block = &Block[Node_Block[node]];
+
+		const int last = node == 0 ? NNodes : node + Tree[node].DNext;
+
+		float hmax = 0;
+
+		for (int child = node + 1, k = 0; child < last; k++) {
+
+			block->Hsml[k] = Node_Hsml[child];
+
+			hmax = max(hmax, Node_Hsml[child]);
+
+			child += Tree[child].DNext < 0 ? 1 : Tree[child].DNext;
+		}
+
+		Node_Hsml[node] = hmax;
+	}
+
+	Block[0].Hsml[0] = Node_Hsml[0];
+
+	Ngb_Hsml = hsml;
+	Ngb_Hsml_Scale = scale;
+
+	Tree_Version++;
+
+	return ;
+}
+
+/*
+ * Interaction lists of the leaves, for a pass over all particle pairs that
+ * are closer than the larger of their hsml, see Find_sph_density(). Leaf a
+ * lists the leaves b >= a in depth first order whose box overlaps the 
+ * sphere of a plus the larger node hsml, so every pair of leaves appears 
+ * once. Runs of LEAF_CHUNK leaves are coloured greedily, so that two chunks
+ * of one colour never write to the same chunk: Threads can scatter to both
+ * leaves of a pair without locks, working through the colours one after 
+ * another. The lists are kept until the next call. Needs Set_tree_hsml().
+ */
+
+const struct Leaf_Pairs *Find_leaf_pairs()
+{
+	Assert(Ngb_Hsml != NULL, "Tree hsml not set, call Set_tree_hsml()");
+
+	struct Leaf_Pairs *lp = &Pairs;
+
+	int nLeaves = 0;
+
+	for (int node = 0; node < NNodes; node++)
+		nLeaves += (Tree[node].DNext < 0);
+
+	if (nLeaves > Max_Leaves) {
+
+		Max_Leaves = nLeaves;
+
+		lp->First = Realloc(lp->First, Max_Leaves * sizeof(*lp->First));
+		lp->Npart = Realloc(lp->Npart, Max_Leaves * sizeof(*lp->Npart));
+		lp->Offset = Realloc(lp->Offset, (Max_Leaves+1) * sizeof(*lp->Offset));
+		lp->Chunk = Realloc(lp->Chunk, (Max_Leaves+1) * sizeof(*lp->Chunk));
+		lp->Colour_Chunk = Realloc(lp->Colour_Chunk, 
+				Max_Leaves * sizeof(*lp->Colour_Chunk));
+		Leaf_Node = Realloc(Leaf_Node, Max_Leaves * sizeof(*Leaf_Node));
+		Chunk_Colour = Realloc(Chunk_Colour, 
+				Max_Leaves * sizeof(*Chunk_Colour));
+		Colour_Mask = Realloc(Colour_Mask, 
+				Max_Leaves * sizeof(*Colour_Mask));
+	}
+
+	Leaf_Index = Realloc(Leaf_Index, Tree_Npart * sizeof(*Leaf_Index));
+
+	lp->NLeaves = 0;
+
+	for (int node = 0; node < NNodes; node++) { // depth first = Peano order
+
+		if (Tree[node].DNext >= 0)
+			continue;
+
+		const int a = lp->NLeaves++;
+
+		lp->First[a] = -(Tree[node].DNext + 1);
+		lp->Npart[a] = Tree[node].Npart;
+		Leaf_Node[a] = node;
+		Leaf_Index[lp->First[a] - Tree_First] = a;
+	}
+
+	lp->Offset[0] = 0;
+
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (int a = 0; a < nLeaves; a++)
+		lp->Offset[a+1] = leaf_partners(a, NULL);
+
+	for (int a = 0; a < nLeaves; a++) // prefix sum
+		lp->Offset[a+1] += lp->Offset[a];
+
+	if (lp->Offset[nLeaves] > Max_Partners) {
+
+		Max_Partners = lp->Offset[nLeaves];
+
+		lp->Partner = Realloc(lp->Partner, Max_Partners*sizeof(*lp->Partner));
+	}
+
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (int a = 0; a < nLeaves; a++)
+		leaf_partners(a, &lp->Partner[lp->Offset[a]]);
+
+	const int nChunks = (nLeaves + LEAF_CHUNK - 1) / LEAF_CHUNK;
+
+	lp->NChunks = nChunks;
+
+	for (int chunk = 0; chunk <= nChunks; chunk++)
+		lp->Chunk[chunk] = min(nLeaves, chunk * LEAF_CHUNK);
+
+	memset(Colour_Mask, 0, nChunks * sizeof(*Colour_Mask));
+
+	lp->NColours = 0;
+
+	for (int chunk = 0; chunk < nChunks; chunk++) { // greedy colouring
+
+		const int first = lp->Offset[lp->Chunk[chunk]]; // incl. own leaves
+		const int last = lp->Offset[lp->Chunk[chunk+1]];
+
+		uint64_t used[LEAF_COLOUR_WORDS] = { 0 };
+
+		for (int i = first; i < last; i++)
+			for (int w = 0; w < LEAF_COLOUR_WORDS; w++)
+				used[w] |= Colour_Mask[lp->Partner[i] / LEAF_CHUNK][w];
+
+		int col = 0;
+
+		while (col < 64*LEAF_COLOUR_WORDS && (used[col/64] >> (col%64) & 1))
+			col++;
+
+		Assert(col < 64*LEAF_COLOUR_WORDS, "Leaf chunk %d needs more than %d "
+				"colours, increase LEAF_CHUNK", chunk, 64*LEAF_COLOUR_WORDS);
+
+		for (int i = first; i < last; i++)
+			Colour_Mask[lp->Partner[i] / LEAF_CHUNK][col/64] |= 1ULL<<(col%64);
+
+		Chunk_Colour[chunk] = col;
+
+		lp->NColours = max(lp->NColours, col + 1);
+	}
+
+	lp->Colour_Offset = Realloc(lp->Colour_Offset, 
+			(lp->NColours + 1) * sizeof(*lp->Colour_Offset));
+
+	memset(lp->Colour_Offset, 0, (lp->NColours+1)*sizeof(*lp->Colour_Offset));
+
+	for (int chunk = 0; chunk < nChunks; chunk++) // counting sort by colour
+		lp->Colour_Offset[Chunk_Colour[chunk] + 1]++;
+
+	for (int col = 0; col < lp->NColours; col++)
+		lp->Colour_Offset[col+1] += lp->Colour_Offset[col];
+
+	for (int chunk = 0; chunk < nChunks; chunk++) 
+		lp->Colour_Chunk[lp->Colour_Offset[Chunk_Colour[chunk]]++] = chunk;
+
+	for (int col = lp->NColours; col > 0; col--) // undo scatter shift
+		lp->Colour_Offset[col] = lp->Colour_Offset[col-1];
+
+	lp->Colour_Offset[0] = 0;
+
+	return lp;
+}
+
+/*
+ * Walk the tree with the bounding sphere of leaf a and its largest hsml. 
+ * Counts the partner leaves b >= a, or stores them if partner is not NULL.
+ * a is its own first partner.
+ */
+
+static int leaf_partners(const int a, int *partner)
+{
+	const float boxsize = Param.Boxsize;
+	const int leaf = Leaf_Node[a];
+	const float hsml = Node_Hsml[leaf];
+
+	float pos[3] = { 0 }, rad = 0;
+
+	for (int i = 0; i < 3; i++) {
+
+		pos[i] = 0.5 * (Bounds[leaf].Hi[i] + Bounds[leaf].Lo[i]);
+
+		rad += p2(0.5 * (Bounds[leaf].Hi[i] - Bounds[leaf].Lo[i]));
+	}
+
+	rad = sqrt(rad) * (1 + 4*FLT_EPSILON) + 4 * FLT_EPSILON * boxsize;
+
+	int cnt = 0;
+
+	if (partner != NULL)
+		partner[cnt] = a;
+
+	cnt++;
+
+	int stack[TREE_STACK_SIZE];
+	int nStack = 0;
+
+	stack[nStack++] = 0; // root
+
+	while (nStack > 0) {
+		
+		const struct Tree_Block *block = &Block[stack[--nStack]];
+
+		int open = open_children(block, pos, hsml, true, rad);
+
+		while (open) {
+
+			int k = __builtin_ctz(open);
+
+			open &= open - 1;
+
+			if (block->Next[k] >= 0) { 
+
+				stack[nStack++] = block->Next[k];
+
+				continue;
+			}
+
+			const int b = Leaf_Index[-(block->Next[k] + 1) - Tree_First];
+
+			if (b <= a)
+				continue;
+
+			if (partner != NULL)
+				partner[cnt] = b;
+
+			cnt++;
+		}
+	}
+
+	return cnt;
+}
+
+/*
+ * Find monopole and quadrupole moments of all nodes for the gravity walk. 
+ * The tree holds one particle type, so all particles have the same mass. 
+ * Leaves are set in parallel, internal nodes bottom up from their children,
+ * shifting the quadrupoles to the new centre of mass. Positions are the 
+ * images nearest to the cell centre, as in find_bounds().
+ */
+
+void Set_tree_moments()
+{
+	const double boxsize = Param.Boxsize;
+	const double boxhalf = Param.Boxsize * 0.5;
+
+	Moments = Realloc(Moments, NNodes * sizeof(*Moments));
+
+	if (Tree_Npart == 0)
+		return ;
+
+	const double mpart = Param.Mpart[P[Tree_First].Type];
+
+	#pragma omp parallel for schedule(static)
+	for (int node = 0; node < NNodes; node++) {
+
+		if (Tree[node].DNext >= 0)
+			continue;
+
+		const int first = -(Tree[node].DNext + 1);
+		const int last = first + Tree[node].Npart;
+
+		double com[3] = { 0 };
+
+		for (int ipart = first; ipart < last; ipart++) {
+
+			for (int i = 0; i < 3; i++) {
+
+				double dx = P[ipart].Pos[i] - Tree[node].Pos[i];
+
+				if (dx > boxhalf)
+					dx -= boxsize;
+				else if (dx < -boxhalf)
+					dx += boxsize;
+
+				com[i] += dx;
+			}
+		}
+
+		for (int i = 0; i < 3; i++)
+			com[i] = Tree[node].Pos[i] + com[i] / max(1, Tree[node].Npart);
+
+		double q[6] = { 0 };
+
+		for (int ipart = first; ipart < last; ipart++) {
+
+			double d[3] = { 0 };
+
+			for (int i = 0; i < 3; i++) {
+
+				d[i] = P[ipart].Pos[i] - com[i];
+
+				if (d[i] > boxhalf)
+					d[i] -= boxsize;
+				else if (d[i] < -boxhalf)
+					d[i] += boxsize;
+			}
+
+			const double r2 = p2(d[0]) + p2(d[1]) + p2(d[2]);
+
+			q[0] += 3*d[0]*d[0] - r2;
+			q[1] += 3*d[1]*d[1] - r2;
+			q[2] += 3*d[2]*d[2] - r2;
+			q[3] += 3*d[0]*d[1];
+			q[4] += 3*d[0]*d[2];
+			q[5] += 3*d[1]*d[2];
+		}
+
+		Moments[node].Mass = mpart * Tree[node].Npart;
+
+		for (int i = 0; i < 3; i++)
+			Moments[node].Com[i] = com[i];
+		
+		for (int i = 0; i < 6; i++)
+			Moments[node].Quad[i] = mpart * q[i];
+	}
+
+	for (int node = NNodes - 1; node >= 0; node--) { // children first
+
+		if (Tree[node].DNext < 0)
+			continue;
+
+		const int last = node == 0 ? NNodes : node + Tree[node].DNext;
+
+		double mass = 0, com[3] = { 0 }, q[6] = { 0 };
+
+		for (int child = node + 1; child < last;) {
+
+			const struct Node_Moments *m = &Moments[child];
+
+			for (int i = 0; i < 3; i++) {
+
+				double dx = m->Com[i] - Tree[node].Pos[i];
+
+				if (dx > boxhalf)
+					dx -= boxsize;
+				else if (dx < -boxhalf)
+					dx += boxsize;
+
+				com[i] += m->Mass * dx;
+			}
+
+			mass += m->Mass;
+			
+			child += Tree[child].DNext < 0 ? 1 : Tree[child].DNext;
+		}
+
+		for (int i = 0; i < 3; i++)
+			com[i] = Tree[node].Pos[i] + com[i] / mass;
+
+		for (int child = node + 1; child < last;) { // parallel axis theorem
+
+			const struct Node_Moments *m = &Moments[child];
+
+			double d[3] = { 0 };
+
+			for (int i = 0; i < 3; i++) {
+
+				d[i] = m->Com[i] - com[i];
+
+				if (d[i] > boxhalf)
+					d[i] -= boxsize;
+				else if (d[i] < -boxhalf)
+					d[i] += boxsize;
+			}
+
+			const double r2 = p2(d[0]) + p2(d[1]) + p2(d[2]);
+
+			q[0] += m->Quad[0] + m->Mass * (3*d[0]*d[0] - r2);
+			q[1] += m->Quad[1] + m->Mass * (3*d[1]*d[1] - r2);
+			q[2] += m->Quad[2] + m->Mass * (3*d[2]*d[2] - r2);
+			q[3] += m->Quad[3] + m->Mass * 3*d[0]*d[1];
+			q[4] += m->Quad[4] + m->Mass * 3*d[0]*d[2];
+			q[5] += m->Quad[5] + m->Mass * 3*d[1]*d[2];
+
+			child += Tree[child].DNext < 0 ? 1 : Tree[child].DNext;
+		}
+
+		Moments[node].Mass = mass;
+
+		for (int i = 0; i < 3; i++)
+			Moments[node].Com[i] = com[i];
+		
+		for (int i = 0; i < 6; i++)
+			Moments[node].Quad[i] = q[i];
+	}
+
+	return ;
+}
+
+/*
+ * Barnes-Hut walk for the potential and acceleration of particle ipart,
+ * which are added to pot and acc. We walk the nodes in depth first order: 
+ * A node is opened if it is larger than GRAV_THETA times the distance to its
+ * centre of mass, or if the particle is within 0.6 node sizes of its centre.
+ * Otherwise it contributes monopole and quadrupole and we skip its subtree.
+ * Forces are Plummer softened with eps. Distances use the nearest periodic
+ * image like the neighbour search, so nodes reaching over half a box from 
+ * the particle are split as well. Needs Set_tree_moments().
+ */
+
+void Gravity_tree(const int ipart, const float eps, float *pot, float acc[3])
+{
+	const float boxsize = Param.Boxsize;
+	const float boxhalf = Param.Boxsize * 0.5;
+	const float eps2 = eps * eps;
+	const float theta2 = GRAV_THETA * GRAV_THETA;
+
+	const float pos_i[3] = { P[ipart].Pos[0], P[ipart].Pos[1], 
+							 P[ipart].Pos[2] };
+	
+	double phi = 0, a[3] = { 0 };
+
+	int node = 0;
+
+	while (node < NNodes) {
+
+		if (Tree[node].DNext < 0) { // leaf, direct sum
+
+			const float mpart = Moments[node].Mass / Tree[node].Npart;
+
+			const int first = -(Tree[node].DNext + 1);
+			const int last = first + Tree[node].Npart;
+
+			for (int jpart = first; jpart < last; jpart++) {
+
+				if (jpart == ipart)
+					continue;
+
+				float d[3] = { 0 };
+
+				for (int i = 0; i < 3; i++) {
+
+					d[i] = pos_i[i] - P[jpart].Pos[i];
+
+					if (d[i] > boxhalf)
+						d[i] -= boxsize;
+					else if (d[i] < -boxhalf)
+						d[i] += boxsize;
+				}
+
+				const float r2 = p2(d[0]) + p2(d[1]) + p2(d[2]) + eps2;
+				const float rinv = 1 / sqrtf(r2);
+				const float mrinv3 = mpart * rinv * rinv * rinv;
+
+				phi -= mpart * rinv;
+
+				a[0] -= mrinv3 * d[0];
+				a[1] -= mrinv3 * d[1];
+				a[2] -= mrinv3 * d[2];
+			}
+
+			node++;
+
+			continue;
+		}
+
+		const struct Node_Moments *m = &Moments[node];
+
+		float d[3] = { 0 }, dc[3] = { 0 };
+
+		for (int i = 0; i < 3; i++) {
+
+			d[i] = pos_i[i] - m->Com[i];
+
+			if (d[i] > boxhalf)
+				d[i] -= boxsize;
+			else if (d[i] < -boxhalf)
+				d[i] += boxsize;
+
+			dc[i] = pos_i[i] - Tree[node].Pos[i];
+
+			if (dc[i] > boxhalf)
+				dc[i] -= boxsize;
+			else if (dc[i] < -boxhalf)
+				dc[i] += boxsize;
+		}
+
+		const float size = Tree[node].Size;
+		const float r2 = p2(d[0]) + p2(d[1]) + p2(d[2]);
+
+		const bool is_close = fabs(dc[0]) < 0.6 * size 
+						   && fabs(dc[1]) < 0.6 * size 
+						   && fabs(dc[2]) < 0.6 * size;
+
+		const bool is_split = fabs(dc[0]) + 0.5 * size > boxhalf  
+						   || fabs(dc[1]) + 0.5 * size > boxhalf 
+						   || fabs(dc[2]) + 0.5 * size > boxhalf;
+
+		if (size * size > theta2 * r2 || is_close || is_split) { // open
+
+			node++;
+
+			continue;
+		}
+
+		const float rinv = 1 / sqrtf(r2 + eps2);
+		const float rinv2 = rinv * rinv;
+		const float rinv3 = rinv * rinv2;
+		const float rinv5 = rinv3 * rinv2;
+
+		const float *q = m->Quad;
+
+		const float qd[3] = { q[0]*d[0] + q[3]*d[1] + q[4]*d[2],
+							  q[3]*d[0] + q[1]*d[1] + q[5]*d[2],
+							  q[4]*d[0] + q[5]*d[1] + q[2]*d[2] };
+
+		const float dqd = d[0]*qd[0] + d[1]*qd[1] + d[2]*qd[2];
+
+		phi -= m->Mass * rinv + 0.5 * dqd * rinv5;
+
+		for (int i = 0; i < 3; i++)
+			a[i] += -m->Mass * rinv3 * d[i] + qd[i] * rinv5 
+				- 2.5 * dqd * rinv5 * rinv2 * d[i];
+
+		node += node == 0 ? NNodes : Tree[node].DNext;
+	}
+
+	*pot += G * phi;
+
+	acc[0] += G * a[0];
+	acc[1] += G * a[1];
+	acc[2] += G * a[2];
+
+	return ;
+}
+
+#ifdef TREE_STATISTICS
+/*
+ * Print the tree size, the number of leaves per level and the counters of 
+ * all threads since the last call, then reset the counters.
+ */
+
+void Print_tree_statistics()
+{
+	const int nFields = sizeof(Tree_Stats) / sizeof(long long);
+
+	long long sum[sizeof(Tree_Stats) / sizeof(long long)] = { 0 };
+
+	#pragma omp parallel
+	{
+	
+	const long long *local = (const long long *) &Tree_Stats;
+	
+	#pragma omp critical
+	for (int i = 0; i < nFields; i++)
+		sum[i] += local[i];
+	
+	memset(&Tree_Stats, 0, sizeof(Tree_Stats));
+
+	} // omp parallel
+
+	struct Tree_Statistics s = { 0 };
+
+	memcpy(&s, sum, sizeof(s));
+
+	int leaves[N_PEANO_TRIPLETS+1] = { 0 };
+
+	for (int node = 0; node < NNodes; node++)
+		if (Tree[node].DNext < 0)
+			leaves[Level(node)]++;
+
+	printf("          Tree nodes=%d of %d, max %d; blocks=%d; leaves per level:",
+			NNodes, Max_Nodes, NNodes_High_Water, NBlocks);
+
+	for (int i = 0; i < N_PEANO_TRIPLETS+1; i++)
+		if (leaves[i] > 0)
+			printf(" %d:%d", i, leaves[i]);
+	
+	const double nQ = max(1, s.Queries);
+	const double nS = max(1, s.Hsml_Solves);
+	const double nP = max(1, s.Hsml_Parts);
+
+	printf("\n          Ngb queries=%lld; per query: nodes opened=%g; "
+			"tested=%g; found=%g\n"
+			"          Retries NGBMAX=%lld; DESNNGB=%lld; count-only=%lld; "
+			"per hsml solve: Newton=%g; bisection=%g; walks per particle=%g\n",
+			s.Queries, s.Nodes_Opened/nQ, s.Parts_Tested/nQ, s.Ngbs_Found/nQ, 
+			s.Retry_Ngbmax, s.Retry_Desnngb, s.Count_Queries, s.Newton_Its/nS, 
+			s.Bisection_Its/nS, s.Hsml_Walks/nP);
+
+	return ;
+}
+#endif // TREE_STATISTICS
+
+int Level(const int node)
+{
+	return Tree[node].Bitfield & 0x3FUL; // return but 0-5
+}
+
+
+void gravity_tree_init()
+{
+	NNodes = 0;
+
+	return ;
+}
+
+/*
+ * The node pool grows in chunks when a build needs more nodes and keeps its
+ * memory across builds, e.g. in the WVT iterations. Nodes are addressed by
+ * index, so growing does not invalidate anything.
+ */
+
+static void grow_node_pool(const int nNodes)
+{
+	NNodes_High_Water = max(NNodes_High_Water, nNodes);
+
+	if (nNodes <= Max_Nodes)
+		return ;
+
+	if (Max_Nodes > 0)
+		printf("   Tree node pool grows from %d to %d nodes \n", Max_Nodes, 
+				nNodes);
+
+	Max_Nodes = (nNodes / TREE_NODE_CHUNK + 1) * TREE_NODE_CHUNK;
+
+	Tree = Realloc(Tree, Max_Nodes * sizeof(*Tree));
 
 	return ;
 }
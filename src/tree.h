@@ -1,7 +1,38 @@
 extern void Build_Tree();
+extern void Build_Tree_Type(const int);
+extern void Refit_Tree();
 extern int Find_ngb_tree(const size_t, const float, int*);
+extern int Find_ngb_tree_symmetric(const int, const float, int*);
+extern void Set_tree_hsml(const float*, const float);
+extern const struct Leaf_Pairs *Find_leaf_pairs();
+extern void Set_tree_moments();
+extern void Gravity_tree(const int, const float, float*, float*);
+extern int Find_ngb_group(const int, const float, int*);
+extern int Find_ngb_group_symmetric(const int, const float, int*);
+extern int Find_ngb_weight(const int, const float, double*, double*);
+extern int Find_knn_tree(const int, const int, int*, float*);
+extern int Find_shell_tree(const float*, const float, const float, int**);
+extern int Find_ball_tree(const float*, const float, int**);
+extern void Find_shell_tree_batch(const int, float (*)[3], const float*, 
+		const float*, int*, int**);
+extern void Select_nearest(int*, float*, const int, const int);
 extern int *Find_ngb_tree_recursive(size_t, float, int);
 int Find_ngb_simple(const int ipart,  const float hsml, int *ngblist);
 extern float Guess_hsml(const size_t ipart, const int DesNumNgb);
+
+extern void Build_Cells(const float*, const float);
+extern int Find_ngb_cells(const int, const float, int*);
+extern int Find_ngb_cells_symmetric(const int, const float, int*);
+
+extern void Start_ngb_cache(const int);
+extern void Add_ngb_cache(const int, const float, const float, const int*, 
+		const float*, const int);
+extern void Finish_ngb_cache();
+extern int Find_ngb_cache(const int, int*, float*, float*);
+
+#ifdef TREE_STATISTICS
+extern void Print_tree_statistics();
+#endif
+
 int Ngbcnt ;
 int Ngblist[NGBMAX];
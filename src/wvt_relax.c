@@ -1,15 +1,28 @@
 #include "globals.h"
 #include "tree.h"
+#include "kernel.h"
 
-#define WVTNNGB DESNNGB // 145 for WC2 that equals WC6 with 295
+#define WVTNNGB DESNNGB // kernel defaults have about the same resolution
+#define REFIT_MAX_DRIFT 1 // rebuild tree after this displacement in d_mps
+#define WVT_CHUNK 64 // neighbours gathered at once in wvt_displacement()
 
 int Find_ngb_simple(const int ipart,  const float hsml, int *ngblist);
 
 static float global_density_model(const int ipart);
-static inline float sph_kernel_M4(const float r, const float h);
-static inline double sph_kernel_WC2(const float r, const float h);
-static inline double sph_kernel_WC6(const float r, const float h);
+static float predict_hsml(const int ipart, const float rho, float *displ[3]);
+KERNEL_INLINE void wvt_displacement(const int type, const int ipart, 
+		const int *ngblist, const int ngbcnt, const float *hsml, 
+		const double step, float displ_i[3]);
+static inline double wvt_step(const int ipart, const double step_mean, 
+		const double rho_mean);
 static inline float gravity_kernel(const float r, const float h);
+#ifdef NGB_BENCHMARK
+KERNEL_INLINE void wvt_displacement_pairs(const int type, const int ipart, 
+		const int *ngblist, const int ngbcnt, const float *hsml, 
+		const double step, float displ_i[3]);
+static void benchmark_ngb_finders(const float *hsml, const double step_mean,
+		const double rho_mean);
+#endif
 
 /* Settle SPH particle with weighted Voronoi tesselations (Diehl+ 2012).
  * Here hsml is not the SPH smoothing length, but is related to a local 
@@ -54,15 +67,34 @@ void Regularise_sph_particles()
 
 	double last_cnt = DBL_MAX;
 
+	double drift = DBL_MAX; // max displacement since the last tree build
+
+	Disable_ngb_cache(); // particles move after every sph pass
+
     int it = -1;
 
     for (;;) {
 			
-		Sort_Particles_By_Peano_Key();	
+		double t0 = omp_get_wtime();
+
+		if (drift > REFIT_MAX_DRIFT) {
+
+			Sort_Particles_By_Peano_Key();	
 	
-		Build_Tree();	
+			Build_Tree();	
+
+			drift = 0;
+
+		} else {
+			
+			Refit_Tree(); // particles moved only a little
+		}
+
+		double t1 = omp_get_wtime();
 
 		Find_sph_quantities();
+
+		double t2 = omp_get_wtime();
 	
         double vSphSum = 0; // total volume defined by hsml
  
@@ -84,60 +116,65 @@ void Regularise_sph_particles()
         for (int ipart = 0; ipart < nPart; ipart++) 
             hsml[ipart] *= norm_hsml;
 
-		#pragma omp parallel for shared(displ, hsml, P) schedule(dynamic, nPart/Omp.NThreads/256)
-        for (int ipart = 0; ipart < nPart; ipart++) { 
+#ifdef NGB_BENCHMARK
+		if (it == -1)
+			benchmark_ngb_finders(hsml, step_mean, rho_mean);
+#endif
 
-            displ[0][ipart] = displ[1][ipart] = displ[2][ipart] = 0;
+		int (*find_ngb)(const int, const float, int*) = 
+			&Find_ngb_group_symmetric; // symmetric search finds all pairs
 
-            int ngblist[NGBMAX] = { 0 };
+		if (Param.Ngb_Finder == 1) {
 
-            //int ngbcnt = Find_ngb_simple(ipart, hsml[ipart]*boxsize, ngblist);
-            int ngbcnt = Find_ngb_tree(ipart, hsml[ipart]*boxsize, ngblist);
+			Build_Cells(hsml, boxsize);
 
-			for (int i = 0; i < ngbcnt; i++) { // neighbour loop
+			find_ngb = &Find_ngb_cells_symmetric;
 
-				int jpart = ngblist[i];
+		} else {
 
-                if (ipart == jpart)
-                    continue;
+			Set_tree_hsml(hsml, boxsize);
+		}
 
-                float dx = (P[ipart].Pos[0] - P[jpart].Pos[0])/boxsize;
-	    		float dy = (P[ipart].Pos[1] - P[jpart].Pos[1])/boxsize;
-    		    float dz = (P[ipart].Pos[2] - P[jpart].Pos[2])/boxsize;
-			
-                dx = dx > 0.5 ? dx-1 : dx; // find closest image
-                dy = dy > 0.5 ? dy-1 : dy;
-                dz = dz > 0.5 ? dz-1 : dz;
-
-                dx = dx < -0.5 ? dx+1 : dx;
-                dy = dy < -0.5 ? dy+1 : dy;
-                dz = dz < -0.5 ? dz+1 : dz; 
-
-                float r2 = (dx*dx + dy*dy + dz*dz);
-                
-                float h = 0.5 * (hsml[ipart] + hsml[jpart]);
-
-    		    if (r2 > p2(h)) 
-                    continue ;
-
-    		    float r = sqrt(r2);
-
-		        float wk = sph_kernel_WC6(r, h);
-                
-				/* scale mean step size with local density */
-
-				double dens_contrast = pow(SphP[ipart].Rho_Model/rho_mean, 1/3);
-				double step = step_mean / dens_contrast;
-				
-				displ[0][ipart] += step * hsml[ipart] * wk * dx/r;
-                displ[1][ipart] += step * hsml[ipart] * wk * dy/r;
-                displ[2][ipart] += step * hsml[ipart] * wk * dz/r;
-            }
-        }
+		double t3 = omp_get_wtime();
+
+		const struct Work_Chunks *wc = Balance_work(COST_WVT, nPart);
+
+		#pragma omp parallel for shared(displ, hsml, P) schedule(dynamic, 1)
+		for (int chunk = 0; chunk < wc->NChunks; chunk++) {
+
+			double t_chunk = omp_get_wtime();
+
+        	for (int ipart = wc->First[chunk]; ipart < wc->First[chunk+1]; ipart++) { 
+
+            	int ngblist[NGBMAX];
+
+            	//int ngbcnt = Find_ngb_simple(ipart, hsml[ipart]*boxsize, ngblist);
+            	int ngbcnt = (*find_ngb)(ipart, hsml[ipart]*boxsize, ngblist);
+
+				double step = wvt_step(ipart, step_mean, rho_mean);
+
+				float displ_i[3] = { 0 };
+
+				KERNEL_SPECIALISE(wvt_displacement, ipart, ngblist, ngbcnt, 
+						hsml, step, displ_i);
+
+				displ[0][ipart] = displ_i[0];
+				displ[1][ipart] = displ_i[1];
+				displ[2][ipart] = displ_i[2];
+
+				Set_cost(COST_WVT, ipart, 1 + ngbcnt);
+        	}
+
+			Add_busy_time(COST_WVT, omp_get_wtime() - t_chunk);
+		}
+
+		double t4 = omp_get_wtime();
 
         int cnt_100 = 0, cnt_10 = 0, cnt_1 = 0 ;
+		double d_max = 0;
 
-		#pragma omp parallel for reduction(+:cnt_100,cnt_10,cnt_1)
+		#pragma omp parallel for reduction(+:cnt_100,cnt_10,cnt_1) \
+			reduction(max:d_max)
         for (int ipart = 0; ipart < nPart; ipart++) { // move particles
 
 			float rho = global_density_model(ipart);
@@ -154,6 +191,8 @@ void Regularise_sph_particles()
             if (d > 0.01 * d_mps)
                 cnt_1++;
 
+			d_max = fmax(d_max, d / d_mps);
+
             P[ipart].Pos[0] += displ[0][ipart];
             P[ipart].Pos[1] += displ[1][ipart];
             P[ipart].Pos[2] += displ[2][ipart];
@@ -193,17 +232,28 @@ void Regularise_sph_particles()
             errMean += err;
 
 			nIn++;
+
+			SphP[ipart].Hsml = predict_hsml(ipart, rho, displ); // next sph
         }
 
         errMean /= nIn;
 
+		drift += d_max;
+
 		errDiff = (errLast - errMean) / errMean;
 
 		double bins[3] = { cnt_100*npart2percent, cnt_10*npart2percent, cnt_1*npart2percent };
 
 		printf("   #%04d: Delta %4g%% > 1; %4g%% > 1/10; %4g%% > 1/100 of d_mps\n" 
-			   "          Error max=%3g; mean=%03g; diff=%03g step_mean=%g\n",
-				it, bins[0], bins[1], bins[2], errMax, errMean,errDiff, step_mean); 
+			   "          Error max=%3g; mean=%03g; diff=%03g step_mean=%g\n"
+			   "          Time tree=%gs; sph=%gs; wvt=%gs\n",
+				it, bins[0], bins[1], bins[2], errMax, errMean,errDiff, step_mean,
+				t1-t0, t2-t1, t4-t3); 
+
+#ifdef TREE_STATISTICS
+		Print_tree_statistics();
+#endif
+		Print_load_balance();
 
 		errLast = errMean;
 
@@ -221,6 +271,10 @@ void Regularise_sph_particles()
 			break;
     }
 
+	Refit_Tree(); // particles moved after the last walk, keep the tree valid
+
+	Enable_ngb_cache();
+
     Free(hsml); Free(displ[0]); Free(displ[1]); Free(displ[2]);
 
     printf("\ndone\n\n"); fflush(stdout);
@@ -228,6 +282,183 @@ void Regularise_sph_particles()
     return ;
 }
 
+#ifdef NGB_BENCHMARK
+/*
+ * Time the tree and the cell grid on the SPH density and on the symmetric
+ * search of the displacement loop, with the state of the first iteration.
+ * The displacement kernels and the batched hsml solver are timed on the 
+ * tree, the pair symmetric density pass at the converged hsml. The SPH 
+ * quantities are restored, so the relaxation does not change.
+ */
+
+static void benchmark_ngb_finders(const float *hsml, const double step_mean,
+		const double rho_mean)
+{
+	const int nPart = Param.Npart[0];
+	const double boxsize = Param.Boxsize;
+
+	struct GasParticleData *sph_save = Malloc(nPart * sizeof(*sph_save));
+	float *rho = Malloc(nPart * sizeof(*rho));
+
+	memcpy(sph_save, SphP, nPart * sizeof(*sph_save));
+
+	double t_sph[2] = { 0 }, t_wvt[2] = { 0 };
+	long long ngbsum[2] = { 0 };
+	double rho_err = 0;
+
+	for (int finder = 0; finder < 2; finder++) {
+
+		memcpy(SphP, sph_save, nPart * sizeof(*SphP));
+
+		double t0 = omp_get_wtime();
+
+		Find_sph_quantities_using(finder, 0);
+
+		double t1 = omp_get_wtime();
+
+		if (finder == 0)
+			Set_tree_hsml(hsml, boxsize);
+		else
+			Build_Cells(hsml, boxsize);
+
+		long long sum = 0;
+
+		#pragma omp parallel for reduction(+:sum) \
+			schedule(dynamic, nPart/Omp.NThreads/256 + 1)
+		for (int ipart = 0; ipart < nPart; ipart++) {
+
+			int ngblist[NGBMAX] = { 0 };
+
+			if (finder == 0)
+				sum += Find_ngb_group_symmetric(ipart, hsml[ipart]*boxsize, 
+						ngblist);
+			else
+				sum += Find_ngb_cells_symmetric(ipart, hsml[ipart]*boxsize, 
+						ngblist);
+		}
+
+		double t2 = omp_get_wtime();
+
+		t_sph[finder] = t1 - t0;
+		t_wvt[finder] = t2 - t1;
+		ngbsum[finder] = sum;
+
+		#pragma omp parallel for reduction(max:rho_err)
+		for (int ipart = 0; ipart < nPart; ipart++) {
+
+			if (finder == 0)
+				rho[ipart] = SphP[ipart].Rho;
+			else
+				rho_err = fmax(rho_err, fabs(SphP[ipart].Rho/rho[ipart] - 1));
+		}
+	}
+
+	Set_tree_hsml(hsml, boxsize);
+
+	float *displ_pairs[3] = { Malloc(nPart * sizeof(**displ_pairs)), 
+							  Malloc(nPart * sizeof(**displ_pairs)),
+							  Malloc(nPart * sizeof(**displ_pairs)) };
+
+	double t_displ[2] = { 0 }, displ_err = 0;
+
+	for (int simd = 0; simd < 2; simd++) { // walk and displacement
+
+		double t0 = omp_get_wtime();
+
+		#pragma omp parallel for reduction(max:displ_err) \
+			schedule(dynamic, nPart/Omp.NThreads/256 + 1)
+		for (int ipart = 0; ipart < nPart; ipart++) {
+
+			int ngblist[NGBMAX];
+
+			int ngbcnt = Find_ngb_group_symmetric(ipart, hsml[ipart]*boxsize,
+					ngblist);
+
+			double step = wvt_step(ipart, step_mean, rho_mean);
+
+			float d[3] = { 0 };
+
+			if (simd == 0) {
+
+				KERNEL_SPECIALISE(wvt_displacement_pairs, ipart, ngblist, 
+						ngbcnt, hsml, step, d);
+
+				displ_pairs[0][ipart] = d[0];
+				displ_pairs[1][ipart] = d[1];
+				displ_pairs[2][ipart] = d[2];
+
+			} else {
+
+				KERNEL_SPECIALISE(wvt_displacement, ipart, ngblist, ngbcnt, 
+						hsml, step, d);
+
+				double diff = sqrt(p2(d[0] - displ_pairs[0][ipart])
+						+ p2(d[1] - displ_pairs[1][ipart])
+						+ p2(d[2] - displ_pairs[2][ipart]));
+
+				double norm = sqrt(p2(displ_pairs[0][ipart])
+						+ p2(displ_pairs[1][ipart]) + p2(displ_pairs[2][ipart]));
+
+				if (norm > 0)
+					displ_err = fmax(displ_err, diff / norm);
+			}
+		}
+
+		t_displ[simd] = omp_get_wtime() - t0;
+	}
+
+	Free(displ_pairs[0]); Free(displ_pairs[1]); Free(displ_pairs[2]);
+
+	memcpy(SphP, sph_save, nPart * sizeof(*SphP));
+
+	double t0 = omp_get_wtime();
+
+	Find_sph_quantities_using(0, 1); // tree, batches
+
+	double t1 = omp_get_wtime();
+
+	double t_batch = t1 - t0, batch_err = 0;
+
+	#pragma omp parallel for reduction(max:batch_err)
+	for (int ipart = 0; ipart < nPart; ipart++) {
+
+		batch_err = fmax(batch_err, fabs(SphP[ipart].Rho/rho[ipart] - 1));
+
+		rho[ipart] = SphP[ipart].Rho;
+	}
+
+	t0 = omp_get_wtime();
+
+	Find_sph_density(); // at the hsml of the last gather pass
+
+	t1 = omp_get_wtime();
+
+	double t_pairs = t1 - t0, pairs_err = 0;
+
+	#pragma omp parallel for reduction(max:pairs_err)
+	for (int ipart = 0; ipart < nPart; ipart++)
+		pairs_err = fmax(pairs_err, fabs(SphP[ipart].Rho/rho[ipart] - 1));
+
+	memcpy(SphP, sph_save, nPart * sizeof(*SphP));
+
+	printf("   Neighbour search benchmark, %d gas particles, %s kernel with "
+		   "%d neighbours \n"
+		   "          sph:  tree %gs, cells %gs, max rho diff %g \n"
+		   "          wvt:  tree %gs, cells %gs, ngbs %lld / %lld \n"
+		   "          wvt displacement: pairs %gs, simd %gs, max diff %g \n"
+		   "          batched hsml on the tree %gs, max rho diff %g \n"
+		   "          pair density %gs, max rho diff %g \n",
+		   nPart, Kernel.Name, DESNNGB, t_sph[0], t_sph[1], rho_err, 
+		   t_wvt[0], t_wvt[1], ngbsum[0], ngbsum[1], t_displ[0], t_displ[1],
+		   displ_err, t_batch, batch_err, 
+		   t_pairs, pairs_err);
+
+	Free(sph_save); Free(rho);
+
+	return ;
+}
+#endif
+
 static float global_density_model(const int ipart)
 {
     const double boxhalf = Param.Boxsize*0.5;
@@ -256,13 +487,37 @@ static float global_density_model(const int ipart)
 
     return rho;
 }
-    
-static inline double sph_kernel_WC2(const float r, const float h)
-{   
-	const float u= r/h;
-    const float t = 1-u;
 
-    return 21/(2*pi)*t*t*t*t*(1+4*u);
+/*
+ * Start of the next hsml solve of a particle that moved by displ, rho is the
+ * model density at the new position. A particle that moved further than the
+ * local d_mps has new neighbours, it takes hsml from the model density. 
+ * Otherwise the last hsml is scaled with the change of the model density.
+ */
+
+static float predict_hsml(const int ipart, const float rho, float *displ[3])
+{
+	const float d = sqrt(p2(displ[0][ipart]) + p2(displ[1][ipart]) 
+			+ p2(displ[2][ipart]));
+
+	const float d_mps = pow(Param.Mpart[0] / rho / DESNNGB, 1.0/3.0);
+
+	if (d > d_mps)
+		return pow(DESNNGB * Param.Mpart[0] / fourpithird / rho, 1.0/3.0);
+
+	return SphP[ipart].Hsml * pow(SphP[ipart].Rho_Model / rho, 1.0/3.0);
+}
+    
+/*
+ * Step size of ipart. The same for all particles: scaling it with the local
+ * model density is off, the relaxation parameters are tuned to a constant
+ * step.
+ */
+
+static inline double wvt_step(const int ipart, const double step_mean, 
+		const double rho_mean)
+{
+	return step_mean;
 }
 
 static inline float gravity_kernel(const float r, const float h)
@@ -274,26 +529,195 @@ static inline float gravity_kernel(const float r, const float h)
     return val * val;
 }
 
-static inline double sph_kernel_WC6(const float r, const float h)
-{   
-	const double u = r/h;
-    const double t = 1-u;
+/*
+ * WVT displacement of ipart, pushed away from its neighbours with the kernel
+ * at the mean hsml of the pair. Positions in units of the boxsize. The
+ * neighbours are gathered in chunks, with AVX the loop over a chunk is
+ * branch free: the kernel polynomial in float SIMD, the three components
+ * summed in vector registers. Pairs beyond the kernel or at zero separation
+ * are masked. Per particle terms are taken out of the loop.
+ */
+
+KERNEL_INLINE void wvt_displacement(const int type, const int ipart,
+		const int *ngblist, const int ngbcnt, const float *hsml,
+		const double step, float displ_i[3])
+{
+	const float box_inv = 1.0 / Param.Boxsize;
+	const float pos_i[3] = { P[ipart].Pos[0] * box_inv,
+							 P[ipart].Pos[1] * box_inv,
+							 P[ipart].Pos[2] * box_inv };
+	const float hsml_i = hsml[ipart];
+
+	float sum[3] = { 0 };
+
+#ifdef __AVX__
+	__m256 sum_x = _mm256_setzero_ps();
+	__m256 sum_y = _mm256_setzero_ps();
+	__m256 sum_z = _mm256_setzero_ps();
+#endif
+
+	for (int start = 0; start < ngbcnt; start += WVT_CHUNK) {
+
+		const int n = min(WVT_CHUNK, ngbcnt - start);
+
+		float dx[WVT_CHUNK], dy[WVT_CHUNK], dz[WVT_CHUNK], h[WVT_CHUNK];
+
+		for (int i = 0; i < n; i++) { // gather
+
+			const int jpart = ngblist[start + i];
+
+			float x = pos_i[0] - P[jpart].Pos[0] * box_inv;
+			float y = pos_i[1] - P[jpart].Pos[1] * box_inv;
+			float z = pos_i[2] - P[jpart].Pos[2] * box_inv;
+
+			x = x > 0.5f ? x-1 : x; // find closest image
+			y = y > 0.5f ? y-1 : y;
+			z = z > 0.5f ? z-1 : z;
+
+			dx[i] = x < -0.5f ? x+1 : x;
+			dy[i] = y < -0.5f ? y+1 : y;
+			dz[i] = z < -0.5f ? z+1 : z;
+
+			h[i] = 0.5f * (hsml_i + hsml[jpart]);
+		}
+
+#ifdef __AVX__
+		for (int i = n; i < ((n + 7) & ~7); i++) { // padding at r = 0
+
+			dx[i] = dy[i] = dz[i] = 0;
+			h[i] = 1;
+		}
+
+		for (int i = 0; i < n; i += 8) {
+
+			const __m256 x = _mm256_loadu_ps(&dx[i]);
+			const __m256 y = _mm256_loadu_ps(&dy[i]);
+			const __m256 z = _mm256_loadu_ps(&dz[i]);
+			const __m256 h_ij = _mm256_loadu_ps(&h[i]);
+
+			const __m256 r2 = madd(x, x, madd(y, y, _mm256_mul_ps(z, z)));
+
+			const __m256 inside = _mm256_and_ps(
+					_mm256_cmp_ps(r2, _mm256_mul_ps(h_ij, h_ij), _CMP_LE_OQ),
+					_mm256_cmp_ps(r2, _mm256_setzero_ps(), _CMP_GT_OQ));
 
-    return 1365.0/(64*pi) *t*t*t*t*t*t*t*t*(1+8*u + 25*u*u + 32*u*u*u);
+			const __m256 r_inv = _mm256_div_ps(_mm256_set1_ps(1),
+					_mm256_sqrt_ps(r2));
+
+			__m256 u = _mm256_div_ps(_mm256_mul_ps(r2, r_inv), h_ij);
+
+			u = _mm256_min_ps(u, _mm256_set1_ps(1));
+
+			__m256 wk, dwk;
+
+			kernel_poly_avx(type, u, &wk, &dwk);
+
+			const __m256 w = _mm256_and_ps(inside, _mm256_mul_ps(wk, r_inv));
+
+			sum_x = madd(w, x, sum_x);
+			sum_y = madd(w, y, sum_y);
+			sum_z = madd(w, z, sum_z);
+		}
+#else
+		for (int i = 0; i < n; i++) {
+
+			const float r2 = dx[i]*dx[i] + dy[i]*dy[i] + dz[i]*dz[i];
+
+			if (r2 > h[i]*h[i] || r2 == 0)
+				continue;
+
+			const float r = sqrtf(r2);
+
+			float wk, dwk;
+
+			kernel_poly(type, r / h[i], &wk, &dwk);
+
+			sum[0] += wk / r * dx[i];
+			sum[1] += wk / r * dy[i];
+			sum[2] += wk / r * dz[i];
+		}
+#endif // __AVX__
+	}
+
+#ifdef __AVX__
+	float lane[3][8];
+
+	_mm256_storeu_ps(lane[0], sum_x);
+	_mm256_storeu_ps(lane[1], sum_y);
+	_mm256_storeu_ps(lane[2], sum_z);
+
+	for (int k = 0; k < 8; k++) {
+
+		sum[0] += lane[0][k];
+		sum[1] += lane[1][k];
+		sum[2] += lane[2][k];
+	}
+#endif
+
+	const double fac = step * hsml_i * Kernel.Norm;
+
+	displ_i[0] += fac * sum[0];
+	displ_i[1] += fac * sum[1];
+	displ_i[2] += fac * sum[2];
+
+	return ;
 }
 
-static inline float sph_kernel_M4(const float r, const float h) // cubic spline
+#ifdef NGB_BENCHMARK
+/*
+ * The displacement pair by pair, as before wvt_displacement(), for the
+ * benchmark.
+ */
+
+KERNEL_INLINE void wvt_displacement_pairs(const int type, const int ipart, 
+		const int *ngblist, const int ngbcnt, const float *hsml, 
+		const double step, float displ_i[3])
 {
-	double wk = 0;
-   	double u = r/h;
- 
-	if(u < 0.5) 
-		wk = (2.546479089470 + 15.278874536822 * (u - 1) * u * u);
-	else
-		wk = 5.092958178941 * (1.0 - u) * (1.0 - u) * (1.0 - u);
+    const double boxsize = Param.Boxsize;
+	const float norm = Kernel.Norm;
+
+	for (int i = 0; i < ngbcnt; i++) { // neighbour loop
+
+		int jpart = ngblist[i];
+
+        if (ipart == jpart)
+            continue;
+
+        float dx = (P[ipart].Pos[0] - P[jpart].Pos[0])/boxsize;
+		float dy = (P[ipart].Pos[1] - P[jpart].Pos[1])/boxsize;
+	    float dz = (P[ipart].Pos[2] - P[jpart].Pos[2])/boxsize;
 	
-	return wk/p3(h);
+        dx = dx > 0.5 ? dx-1 : dx; // find closest image
+        dy = dy > 0.5 ? dy-1 : dy;
+        dz = dz > 0.5 ? dz-1 : dz;
+
+        dx = dx < -0.5 ? dx+1 : dx;
+        dy = dy < -0.5 ? dy+1 : dy;
+        dz = dz < -0.5 ? dz+1 : dz; 
+
+        float r2 = (dx*dx + dy*dy + dz*dz);
+        
+        float h = 0.5 * (hsml[ipart] + hsml[jpart]);
+
+	    if (r2 > p2(h)) 
+            continue ;
+
+	    float r = sqrt(r2);
+
+		float wk, dwk;
+
+		kernel_poly(type, r / h, &wk, &dwk);
+
+		wk *= norm;
+		
+		displ_i[0] += step * hsml[ipart] * wk * dx/r;
+        displ_i[1] += step * hsml[ipart] * wk * dy/r;
+        displ_i[2] += step * hsml[ipart] * wk * dz/r;
+    }
+
+	return ;
 }
+#endif
 
 int Find_ngb_simple(const int ipart,  const float hsml, int *ngblist)
 {